@@ -1,45 +1,98 @@
 #pragma once
 #include <common.h>
 
-#define PAGE_SIZE (16*1024*1024)        // 16MB
+#define PAGE_SIZE (4*1024)              // 4KB
 #define MIN_OBJECT_SIZE 8               // 8Byte
 #define MIN_OBJECT_LEVEL 3
 #define MAX_OBJECT_SIZE (16*1024*1024)  // 16MB
 #define MAX_OBJECT_LEVEL 24
-#define SMALL_OBJECT_LEVEL 20           // 1MB
+#define SMALL_OBJECT_LEVEL 20           // 1MB, bigger objects get pages of their own
+#define MAX_SIZE_CLASS (SMALL_OBJECT_LEVEL - MIN_OBJECT_LEVEL + 1) // classes of small objects, one per power of 2
+#define SPAN_OBJECTS 8                  // objects in a span of small objects, at least
+#define MAX_SPAN_SIZE (1024*1024)       // 1MB, unless a page holds more
+#define PAGE_LISTS 128                  // free spans of 1..127 pages have a list each, longer ones share one
+#define TRANSFER_SIZE (64*1024)         // 64KB of objects move between central and thread cache at once, 2..32 objects
+#define TRANSFER_BATCHES 64             // batches kept in the transfer cache of a level, at most
+#define TRANSFER_CACHE_SIZE (1024*1024) // 1MB of batches kept per level, at most
+#define MAX_LIST_LENGTH 8192            // objects a thread cache list grows to, at most
+#define MAX_OVERAGES 3                  // overflows of a list before it shrinks by a batch
+#define SAMPLE_INTERVAL (512*1024)      // 512KB allocated between two sampled allocation sites, on average
+#define SAMPLE_SITES 64                 // allocation sites each thread keeps samples of
 #ifndef TEST
     #define MAX_THREAD 8                // MAX_CPU = 8
 #else
     #define MAX_THREAD 16
 #endif
-#define MAX_SPAN 256                    // 4GB/256MB
 #define MAX_HEAP_SIZE (256*1024*1024)    // TODO: 64MB
+#define MAX_SPAN (MAX_HEAP_SIZE / PAGE_SIZE) // a span starts at each page, at most
+// #define PMM_DEBUG                    // shadow memory checks and tracing of every call
 
 
 typedef struct {
-    uintptr_t head  [MAX_OBJECT_LEVEL + 1];
-    int count       [MAX_OBJECT_LEVEL + 1];
+    uintptr_t head  [MAX_SIZE_CLASS + 1];
+    int count       [MAX_SIZE_CLASS + 1];
+    int max_length  [MAX_SIZE_CLASS + 1]; // slow start: objects fetched at once below a batch, overflow limit above
+    int overages    [MAX_SIZE_CLASS + 1];
 } FreeList;
 
+// Counters of a size class on one thread, written by that thread only
 typedef struct {
-    FreeList freelist;
-} ThreadCache;
+    unsigned long allocs, frees;
+    unsigned long hits, misses;     // the local list had an object or was empty
+    unsigned long refills;          // transfers from the central cache
+    unsigned long remote_frees;     // objects of spans another thread owns
+    unsigned long remote_taken;     // remote frees taken back, by their owner or the central cache
+} ClassStats;
+
+typedef struct {
+    uintptr_t site;                 // return address of a caller of pmm->alloc
+    unsigned long samples, bytes;
+} SiteSamples;
 
 typedef struct {
     FreeList freelist;
-} CentralCache;
+    uintptr_t remote[MAX_SIZE_CLASS + 1]; // objects of its spans freed by other threads, pushed lock-free, taken whole by exchange
+    ClassStats stats[MAX_SIZE_CLASS + 1]; // class 0: large objects and pages
+    long sample_countdown;                // bytes to allocate before the next sample
+    SiteSamples sites[SAMPLE_SITES];      // open addressing by site
+} ThreadCache;
 
-enum span_status { ON_HEAP, IN_USE };
+// ON_HEAP: free pages of the page heap, IN_USE: small objects of one size class,
+// LARGE: a single object bigger than 1 << SMALL_OBJECT_LEVEL
+enum span_status { ON_HEAP, IN_USE, LARGE };
 
-typedef struct {
+// A run of consecutive pages, described by the entry of its first page in spans[]
+typedef struct span {
     enum span_status status;
-    size_t central_size; // TODO: 初始16MB, 进线程减少，离开线程增加，用来归还
-    int level;
+    int npages;
+    int size_class; // IN_USE: index into the size class table
+    int owner; // IN_USE: the thread cache it last handed objects to, frees from other threads go back there
+    int free_count; // IN_USE: objects on freelist, the span goes back to the heap once that is all of them
+    uintptr_t freelist; // IN_USE: its free objects that are not in a thread cache, threaded through them
+    struct span *prev, *next; // ON_HEAP: the page heap free list of its length, IN_USE: the central list of its level
 } Span;
 
+// The central cache keeps free objects in their spans
+typedef struct {
+    Span *spans[MAX_SIZE_CLASS + 1]; // spans with free objects, by size class
+    int free_spans[MAX_SIZE_CLASS + 1]; // of those, the ones with all of their objects free
+    uintptr_t batches[MAX_SIZE_CLASS + 1][TRANSFER_BATCHES]; // transfer cache: full batches, linked and ready to be a thread cache list
+    int batch_count[MAX_SIZE_CLASS + 1];
+    int spans_in_use[MAX_SIZE_CLASS + 1];
+} CentralCache;
+
 /** @return: tid - 1 */
 int current_thread_id();
 
+// Whole pages, next to MODULE(pmm) since framework/kernel.h is fixed by the judge.
+// align is a power of 2, at least PAGE_SIZE is used. pmm->free takes them too
+/** @return: npages pages starting at a multiple of align, or NULL */
+void *alloc_pages(int npages, size_t align);
+void free_pages(void *ptr);
+
+// Prints the counters of every size class, the page heap and the sampled allocation sites
+void pmm_stats();
+
 #ifndef TEST
     #define RAND() (rand())
 #else
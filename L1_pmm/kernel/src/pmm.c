@@ -9,16 +9,28 @@
 #define ALIGN_UP(value, alignment) (((value) + (alignment) - 1) & ~((alignment) - 1))
 #define ALIGN_DOWN(value, alignment) ((value) & ~((alignment) - 1))
 
+// Tracing and shadow memory checking only exist with PMM_DEBUG, the fast path
+// of kalloc/kfree touches nothing but the current cpu's thread cache
+#ifdef PMM_DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
 // ~Begin global variables
 #ifndef TEST
-spinlock_t lock_central[MAX_OBJECT_LEVEL + 1];
+spinlock_t lock_central[MAX_SIZE_CLASS + 1];
 spinlock_t lock_heap = spin_init("lock_heap");
+#ifdef PMM_DEBUG
 spinlock_t lock_shadow = spin_init("lock_shadow");
+#endif
 #else
-pthread_mutex_t lock_central[MAX_OBJECT_LEVEL + 1] = { [0 ... MAX_OBJECT_LEVEL] = PTHREAD_MUTEX_INITIALIZER };
+pthread_mutex_t lock_central[MAX_SIZE_CLASS + 1] = { [0 ... MAX_SIZE_CLASS] = PTHREAD_MUTEX_INITIALIZER };
 pthread_mutex_t lock_heap = PTHREAD_MUTEX_INITIALIZER;
+#ifdef PMM_DEBUG
 pthread_mutex_t lock_shadow = PTHREAD_MUTEX_INITIALIZER;
 #endif
+#endif
 
 #ifdef TEST
 // heap without am
@@ -31,22 +43,32 @@ static Area heap;
 static ThreadCache thread_caches[MAX_THREAD];
 static CentralCache central_cache;
 static Span spans[MAX_SPAN];
-static size_t SPAN_NUM;
-static uintptr_t heap_head = nullptr;
+static size_t SPAN_NUM; // pages in the heap
+static int page_span[MAX_SPAN]; // page -> first page of its span, kept for the first and last page of a free span
+static Span *free_spans[PAGE_LISTS]; // page heap: free spans of i pages, the last list has the longer ones
+#ifdef PMM_DEBUG
 static unsigned char shadows[MAX_HEAP_SIZE / 8]; // TODO: big shadow memory cause qemu crash
+#endif
 // ~End global variables
 
 int current_thread_id() {
 #ifndef TEST
     return cpu_current();
 #else
+    // Looked up once per thread, it is on the fast path
+    static __thread int thread_id = -1;
+    if (thread_id != -1)
+        return thread_id;
     pthread_t pthread_id = pthread_self();
     for (int i = 0; i < 4096; i++)
     {
         if (threads_[i].thread == pthread_id)
-            return i;
+        {
+            thread_id = i;
+            break;
+        }
     }
-    return -1;
+    return thread_id;
 #endif
 }
 
@@ -60,25 +82,32 @@ int current_thread_id() {
 
 // Available area
 uintptr_t heap_start() { return ALIGN_UP((uintptr_t)heap.start, PAGE_SIZE); }
-uintptr_t heap_end() { return ALIGN_DOWN((uintptr_t)heap.end, PAGE_SIZE); } // exclusive
+uintptr_t heap_end() // exclusive, spans[] covers at most MAX_HEAP_SIZE
+{
+    uintptr_t end = ALIGN_DOWN((uintptr_t)heap.end, PAGE_SIZE);
+    return end - heap_start() > MAX_HEAP_SIZE ? heap_start() + MAX_HEAP_SIZE : end;
+}
 
 #define CHECK_HEAP(ptr) \
     ({ assert(heap_start() <= (ptr) && (ptr) <= heap_end()); })
 
 #define CHECK_SPAN(span) \
     ({ assert( \
-        ((span).status == ON_HEAP && (span).central_size == 0) \
-        || ((span).status == IN_USE && 0 <= (span).central_size && (span).central_size <= PAGE_SIZE) ); })
+        ((span).status == ON_HEAP && (span).free_count == 0) \
+        || ((span).status == LARGE && (span).free_count == 0) \
+        || ((span).status == IN_USE && 0 <= (span).free_count && (span).free_count <= span_objects((span).size_class)) ); })
 
-#define CHECK_LEVEL(level) \
-    ({ assert(MIN_OBJECT_LEVEL <= (level) && (level) <= MAX_OBJECT_LEVEL); })
+#define CHECK_CLASS(size_class) \
+    ({ assert(1 <= (size_class) && (size_class) <= MAX_SIZE_CLASS); })
 
-#define CHECK_FREELIST(freelist, level) \
+// Walks the whole list, so only with PMM_DEBUG
+#ifdef PMM_DEBUG
+#define CHECK_FREELIST(freelist, size_class) \
     ({ \
-        CHECK_LEVEL((level)); \
-        int _expected = (freelist)->count[(level)]; \
+        CHECK_CLASS((size_class)); \
+        int _expected = (freelist)->count[(size_class)]; \
         int _got = 0; \
-        uintptr_t _loop_ptr = (freelist)->head[(level)]; \
+        uintptr_t _loop_ptr = (freelist)->head[(size_class)]; \
         while (_loop_ptr != nullptr) \
         { \
             _loop_ptr = next(_loop_ptr); \
@@ -88,15 +117,20 @@ uintptr_t heap_end() { return ALIGN_DOWN((uintptr_t)heap.end, PAGE_SIZE); } // e
         } \
         assert(_expected == _got); \
     })
+#else
+#define CHECK_FREELIST(freelist, size_class) \
+    ({ CHECK_CLASS((size_class)); })
+#endif
 
 #define CHECK_WHOLE_FREELIST(freelist) \
     ({ \
-        for (int _level = MIN_OBJECT_LEVEL; _level <= MAX_OBJECT_LEVEL; _level++) \
+        for (int _size_class = 1; _size_class <= MAX_SIZE_CLASS; _size_class++) \
         { \
-            CHECK_FREELIST((freelist), _level); \
+            CHECK_FREELIST((freelist), _size_class); \
         } \
     })
 
+#ifdef PMM_DEBUG
 static unsigned char *addr2shadow(uintptr_t addr)
 {
     CHECK_HEAP(addr);
@@ -107,6 +141,25 @@ static unsigned char *addr2shadow(uintptr_t addr)
     return shadows + offset;
 }
 
+// Use shadow memory to check validation: the shadow of [start, start + size)
+// must be all `expected` (0 free, 0xff allocated), and is then flipped
+static void check_shadow(uintptr_t start, size_t size, unsigned char expected)
+{
+    mutex_lock(&lock_shadow);
+    uintptr_t end = start + size;
+    CHECK_HEAP(start);
+    CHECK_HEAP(end);
+    unsigned char *shadow_start = addr2shadow(start);
+    unsigned char *shadow_end = addr2shadow(end);
+    for (unsigned char *ptr = shadow_start; ptr < shadow_end; ptr++)
+        assert((*ptr) == expected);
+    memset(shadow_start, (unsigned char)~expected, size / 8);
+    mutex_unlock(&lock_shadow);
+}
+#else
+#define check_shadow(start, size, expected)
+#endif
+
 static uintptr_t next(uintptr_t ptr) {
     assert(ptr != nullptr);
     uintptr_t new_ptr = *((uintptr_t*)ptr);
@@ -127,13 +180,7 @@ static size_t level_of(size_t size)
     if (size <= MIN_OBJECT_SIZE)
         return MIN_OBJECT_LEVEL;
 
-    size = size - 1;
-    int result = 0;
-    while (size)
-    {
-        size = size >> 1;
-        result++;
-    }
+    int result = 8 * sizeof(unsigned long) - __builtin_clzl(size - 1);
     assert(MIN_OBJECT_LEVEL <= result && result <= MAX_OBJECT_LEVEL);
     return result;
 }
@@ -143,31 +190,47 @@ static int pow_of2(int level)
     return 1 << level;
 }
 
-// Number of objects to move from central cache to local cache at this level
-static size_t move_count(int level) {
-    assert(MIN_OBJECT_LEVEL <= level && level <= MAX_OBJECT_LEVEL);
-    return 1 << (MAX_OBJECT_LEVEL - level);
+// Size classes of small objects: one per power of 2 from MIN_OBJECT_SIZE on,
+// class 0 is none. pmm->alloc promises memory aligned to the size rounded up
+// to a power of 2, so objects of sizes in between could not be packed closer
+static int class_of(size_t size)
+{
+    return level_of(size) - MIN_OBJECT_LEVEL + 1;
 }
 
-static void move(FreeList *from, FreeList *to, int level, int count) {
-    CHECK_FREELIST(from, level);
-    CHECK_FREELIST(to, level);
-    assert(from->count[level] >= count);
-    uintptr_t first = from->head[level];
-    uintptr_t last = first;
-    int number = count;
-    while (--number > 0)
-    {
-        last = next(last);
-        assert(last != nullptr);
-    }
-    from->head[level] = next(last);
-    from->count[level] -= count;
-    link_ptr(last, to->head[level]);
-    to->head[level] = first;
-    to->count[level] += count;
-    CHECK_FREELIST(from, level);
-    CHECK_FREELIST(to, level);
+static size_t class_size(int size_class)
+{
+    return pow_of2(size_class + MIN_OBJECT_LEVEL - 1);
+}
+
+// Pages of a span of small objects of this size class: SPAN_OBJECTS of them,
+// or fewer when that would be more than MAX_SPAN_SIZE
+static int span_pages(int size_class)
+{
+    size_t size = class_size(size_class);
+    size_t objects = MAX_SPAN_SIZE / size;
+    if (objects > SPAN_OBJECTS)
+        objects = SPAN_OBJECTS;
+    if (objects < 1)
+        objects = 1;
+    return ALIGN_UP(objects * size, PAGE_SIZE) / PAGE_SIZE;
+}
+
+static int span_objects(int size_class) {
+    return span_pages(size_class) * PAGE_SIZE / class_size(size_class);
+}
+
+// Number of objects to move between central cache and local cache at once of this size class
+static int move_count(int size_class) {
+    CHECK_CLASS(size_class);
+    int count = TRANSFER_SIZE / class_size(size_class);
+    return count < 2 ? 2 : count > 32 ? 32 : count;
+}
+
+// Number of batches the transfer cache keeps of this size class
+static int transfer_slots(int size_class) {
+    int slots = TRANSFER_CACHE_SIZE / (move_count(size_class) * class_size(size_class));
+    return slots < TRANSFER_BATCHES ? slots : TRANSFER_BATCHES;
 }
 
 static int span_idx(uintptr_t ptr) {
@@ -176,12 +239,110 @@ static int span_idx(uintptr_t ptr) {
     return index;
 }
 
+static uintptr_t span_addr(Span *span) {
+    return heap_start() + (span - spans) * (uintptr_t)PAGE_SIZE;
+}
+
 static Span* span_of(uintptr_t ptr) {
     CHECK_HEAP(ptr);
     int index = span_idx(ptr);
-    return &spans[index];
+    return &spans[page_span[index]];
+}
+
+// Point every page of the span to it
+static void map_span(Span *span) {
+    int first = span - spans;
+    for (int i = first; i < first + span->npages; i++)
+        page_span[i] = first;
+}
+
+// ~Begin page heap: free spans in segregated lists by length, split on
+// allocation and merged with their free neighbours when freed. Callers hold lock_heap
+
+static Span **free_list_of(int npages) {
+    return &free_spans[npages < PAGE_LISTS ? npages : PAGE_LISTS - 1];
 }
 
+static void heap_insert(int first, int npages) {
+    Span *span = &spans[first];
+    span->status = ON_HEAP;
+    span->npages = npages;
+    span->size_class = 0;
+    span->free_count = 0;
+    page_span[first] = first;
+    page_span[first + npages - 1] = first;
+    Span **list = free_list_of(npages);
+    span->prev = nullptr;
+    span->next = *list;
+    if (*list != nullptr)
+        (*list)->prev = span;
+    *list = span;
+}
+
+static void heap_remove(Span *span) {
+    assert(span->status == ON_HEAP);
+    if (span->prev != nullptr)
+        span->prev->next = span->next;
+    else
+        *free_list_of(span->npages) = span->next;
+    if (span->next != nullptr)
+        span->next->prev = span->prev;
+}
+
+// Take npages pages starting at a multiple of align bytes (a power of 2) from the
+// heap: the first fit in the shortest list that can have one, so long spans are
+// only split when nothing shorter fits
+static Span *heap_alloc_pages(int npages, uintptr_t align) {
+    for (int length = npages < PAGE_LISTS ? npages : PAGE_LISTS - 1; length < PAGE_LISTS; length++)
+    {
+        for (Span *span = free_spans[length]; span != nullptr; span = span->next)
+        {
+            int first = span - spans;
+            int end = first + span->npages;
+            uintptr_t start_addr = ALIGN_UP(span_addr(span), align);
+            if (start_addr + (uintptr_t)npages * PAGE_SIZE > span_addr(span) + (uintptr_t)span->npages * PAGE_SIZE)
+                continue;
+            int start = (start_addr - heap_start()) / PAGE_SIZE;
+
+            // Give back what is left on both sides
+            heap_remove(span);
+            if (start > first)
+                heap_insert(first, start - first);
+            if (start + npages < end)
+                heap_insert(start + npages, end - start - npages);
+            Span *result = &spans[start];
+            result->npages = npages;
+            result->free_count = 0;
+            map_span(result);
+            return result;
+        }
+    }
+    return nullptr;
+}
+
+// Returns the free span it ended up in
+static Span *heap_free_pages(Span *span) {
+    int first = span - spans;
+    int npages = span->npages;
+    // Merge with the free spans right before and after it
+    if (first > 0 && spans[page_span[first - 1]].status == ON_HEAP)
+    {
+        Span *left = &spans[page_span[first - 1]];
+        heap_remove(left);
+        npages += left->npages;
+        first = left - spans;
+    }
+    int end = first + npages;
+    if (end < SPAN_NUM && spans[end].status == ON_HEAP)
+    {
+        heap_remove(&spans[end]);
+        npages += spans[end].npages;
+    }
+    heap_insert(first, npages);
+    return &spans[first];
+}
+// ~End page heap
+
 static void pmm_init() {
 #ifndef TEST
     uintptr_t pmsize = (
@@ -204,7 +365,7 @@ static void pmm_init() {
 
     // Init locks
 #ifndef TEST
-    for (int i = MIN_OBJECT_LEVEL; i <= MAX_OBJECT_LEVEL; i++) {
+    for (int i = 1; i <= MAX_SIZE_CLASS; i++) {
 
         char name[30];
         sprintf(name, "lock_central_%d", i);
@@ -212,98 +373,273 @@ static void pmm_init() {
     }
 #endif
 
+#ifdef PMM_DEBUG
     // Init shadows
     memset(shadows, 0x0, sizeof(shadows));
+#endif
 
-    // Init spans
-    SPAN_NUM = (heap_end() - heap_start()) / PAGE_SIZE;
-    for (int i = 0; i < SPAN_NUM; i++) {
-        spans[i].status = ON_HEAP;
-        spans[i].level = 0;
-    }
-
-    // Init heap list
-    heap_head = heap_start();
-    uintptr_t heap_tail = heap_start();
-    for (uintptr_t ptr = heap_start() + PAGE_SIZE; ptr < heap_end(); ptr += PAGE_SIZE)
+    // Init thread caches: slow start, one object at the first transfer
+    for (int i = 0; i < MAX_THREAD; i++)
     {
-        link_ptr(heap_tail, ptr);
-        heap_tail = ptr;
+        for (int size_class = 1; size_class <= MAX_SIZE_CLASS; size_class++)
+            thread_caches[i].freelist.max_length[size_class] = 1;
+        thread_caches[i].sample_countdown = SAMPLE_INTERVAL;
     }
+
+    // Init page heap: one free span of all pages
+    SPAN_NUM = (heap_end() - heap_start()) / PAGE_SIZE;
+    heap_insert(0, SPAN_NUM);
+}
+
+// ~Begin central cache lists: the spans of each size class that have free objects,
+// callers hold lock_central[size_class]
+
+static void central_insert(Span *span) {
+    Span **list = &central_cache.spans[span->size_class];
+    span->prev = nullptr;
+    span->next = *list;
+    if (*list != nullptr)
+        (*list)->prev = span;
+    *list = span;
+}
+
+static void central_remove(Span *span) {
+    if (span->prev != nullptr)
+        span->prev->next = span->next;
+    else
+        central_cache.spans[span->size_class] = span->next;
+    if (span->next != nullptr)
+        span->next->prev = span->prev;
 }
+// ~End central cache lists
 
 // Allocate memory: heap -> central
-static int alloc_heap(int level)
+static int alloc_heap(int size_class)
 {
     mutex_lock(&lock_heap);
-    if (heap_head == nullptr)
+    // Objects are aligned to their size, so are spans of objects bigger than a page
+    Span *span = heap_alloc_pages(span_pages(size_class), class_size(size_class));
+    if (span == nullptr)
     {
         mutex_unlock(&lock_heap);
         return 0;
     }
-
-    // Heap is enough for allocating
-    assert(heap_head != nullptr);
-    uintptr_t alloc_addr = heap_head;
-    Span *span = span_of(alloc_addr);
-    assert(span->status == ON_HEAP && span->central_size == 0);
     span->status = IN_USE;
-    span->central_size = PAGE_SIZE;
-    span->level = level;
-    printf("span: %d, status: IN_USE\n", span_idx(alloc_addr));
-    heap_head = next(heap_head);
-    FreeList *central_freelist = &central_cache.freelist;
-    for (uintptr_t loop_ptr = alloc_addr; loop_ptr < alloc_addr + PAGE_SIZE; loop_ptr += pow_of2(level))
+    span->size_class = size_class;
+    mutex_unlock(&lock_heap);
+
+    // Heap is enough for allocating, the span is ours alone until it is in the central cache
+    uintptr_t alloc_addr = span_addr(span);
+    size_t size = class_size(size_class);
+    debug("span: %d, pages: %d, status: IN_USE\n", span_idx(alloc_addr), span->npages);
+    span->freelist = nullptr;
+    for (uintptr_t loop_ptr = alloc_addr + (span_objects(size_class) - 1) * size; loop_ptr >= alloc_addr; loop_ptr -= size)
     {
-        link_ptr(loop_ptr, central_freelist->head[level]);
-        central_freelist->head[level] = loop_ptr;
+        link_ptr(loop_ptr, span->freelist);
+        span->freelist = loop_ptr;
     }
-    central_freelist->count[level] += move_count(level);
-    CHECK_FREELIST(central_freelist, level);
+    span->free_count = span_objects(size_class);
+    central_insert(span);
+    central_cache.free_spans[size_class]++;
+    central_cache.spans_in_use[size_class]++;
+    return 1;
+}
 
+// Allocate memory: heap -> whole pages, with no size class in between
+void *alloc_pages(int npages, size_t align)
+{
+    if (npages <= 0 || npages > SPAN_NUM || (align & (align - 1)) != 0)
+    {
+        debug("Allocated memory at NULL\n");
+        return nullptr;
+    }
+    mutex_lock(&lock_heap);
+    Span *span = heap_alloc_pages(npages, align < PAGE_SIZE ? PAGE_SIZE : align);
+    if (span != nullptr)
+    {
+        span->status = LARGE;
+        span->size_class = 0;
+    }
     mutex_unlock(&lock_heap);
-    return 1;
+    if (span == nullptr)
+    {
+        debug("Allocated memory at NULL\n");
+        return nullptr;
+    }
+    int thread_id = current_thread_id();
+    if (thread_id != -1)
+        thread_caches[thread_id].stats[0].allocs++;
+    uintptr_t alloc_start = span_addr(span);
+    debug("Allocated large memory at %p, pages: %d\n", (void *)alloc_start, span->npages);
+    check_shadow(alloc_start, span->npages * PAGE_SIZE, 0);
+    return (void *)alloc_start;
 }
 
-// Allocate memory: central -> thread cache
-static int alloc_central(int level)
+// Allocate memory: heap -> a large object, its pages are rounded up to a
+// page but aligned to the power of 2 above size
+static void *alloc_large(size_t size, int level)
 {
-    mutex_lock(&lock_central[level]);
+    return alloc_pages(ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE, pow_of2(level));
+}
 
-    int thread_id = current_thread_id();
-    ThreadCache *thread_cache = &thread_caches[thread_id];
+// Allocate memory: remote frees -> thread cache. Only the owner takes its
+// remote list, so taking all of it at once leaves no ABA problem
+static int alloc_remote(int size_class)
+{
+    ThreadCache *thread_cache = &thread_caches[current_thread_id()];
     FreeList *freelist = &thread_cache->freelist;
-    FreeList *central_freelist = &central_cache.freelist;
-    if (central_freelist->count[level] < move_count(level))
+    uintptr_t head = __atomic_exchange_n(&thread_cache->remote[size_class], nullptr, __ATOMIC_ACQUIRE);
+    if (head == nullptr)
+        return 0;
+
+    int number = 1;
+    uintptr_t tail = head;
+    while (next(tail) != nullptr)
     {
-        int result = alloc_heap(level);
-        if (result == 0)
+        tail = next(tail);
+        number++;
+    }
+    link_ptr(tail, freelist->head[size_class]);
+    freelist->head[size_class] = head;
+    freelist->count[size_class] += number;
+    CHECK_FREELIST(freelist, size_class);
+    thread_cache->stats[size_class].remote_taken += number;
+    return number;
+}
+
+// Return a span whose objects are all free to the heap: it only has to leave
+// the central list of its size class. Callers hold lock_central[size_class]
+static void free2heap(Span *span)
+{
+    central_remove(span);
+    central_cache.spans_in_use[span->size_class]--;
+    debug("span id: %d, pages: %d, status: ON_HEAP\n", (int)(span - spans), span->npages);
+    mutex_lock(&lock_heap);
+    heap_free_pages(span);
+    mutex_unlock(&lock_heap);
+}
+
+// Free memory: a list of objects -> the freelists of their spans, returns its
+// length. Callers hold lock_central[size_class]
+static int free2spans(int size_class, uintptr_t head)
+{
+    int CENTRAL_THREASHOLD = 4; // spans with all objects free kept in central cache, per size class
+    int number = 0;
+    while (head != nullptr)
+    {
+        uintptr_t object = head;
+        CHECK_HEAP(object);
+        head = next(object);
+        number++;
+
+        Span *span = span_of(object);
+        link_ptr(object, span->freelist);
+        span->freelist = object;
+        span->free_count++;
+        CHECK_SPAN(*span);
+        if (span->free_count == 1)
+            central_insert(span);
+        if (span->free_count == span_objects(size_class))
         {
-            mutex_unlock(&lock_central[level]);
-            return 0;
+            // If central cache is oversized, return memory to heap
+            if (central_cache.free_spans[size_class] < CENTRAL_THREASHOLD)
+                central_cache.free_spans[size_class]++;
+            else
+                free2heap(span);
         }
     }
+    return number;
+}
+
+// Free memory: remote lists of every thread -> the freelists of their spans,
+// for owners that stopped allocating this size class and would never take
+// them. Taking a whole list with one exchange is safe next to its owner doing
+// the same. Callers hold lock_central[size_class]
+static int reclaim_remote(int size_class)
+{
+    int number = 0;
+    for (int i = 0; i < MAX_THREAD; i++)
+        number += free2spans(size_class, __atomic_exchange_n(&thread_caches[i].remote[size_class], nullptr, __ATOMIC_ACQUIRE));
+    thread_caches[current_thread_id()].stats[size_class].remote_taken += number;
+    return number;
+}
+
+// Allocate memory: central -> thread cache, number objects at most
+static int alloc_central(int size_class, int number)
+{
+    mutex_lock(&lock_central[size_class]);
+
+    int thread_id = current_thread_id();
+    ThreadCache *thread_cache = &thread_caches[thread_id];
+    FreeList *freelist = &thread_cache->freelist;
+    // A full batch of the transfer cache becomes the empty local list in one splice
+    if (number == move_count(size_class) && central_cache.batch_count[size_class] > 0)
+    {
+        assert(freelist->head[size_class] == nullptr);
+        freelist->head[size_class] = central_cache.batches[size_class][--central_cache.batch_count[size_class]];
+        freelist->count[size_class] = number;
+        CHECK_FREELIST(freelist, size_class);
+        mutex_unlock(&lock_central[size_class]);
+        // The batch is ours now, so are its spans: frees of its objects stay local
+        for (uintptr_t object = freelist->head[size_class]; object != nullptr; object = next(object))
+            __atomic_store_n(&span_of(object)->owner, thread_id, __ATOMIC_RELAXED);
+        return number;
+    }
 
-    // Central cache is enough for allocating
-    assert(central_freelist->count[level] >= move_count(level));
-    uintptr_t dummy_memory;
-    uintptr_t loop_ptr = (uintptr_t)&dummy_memory;
-    link_ptr(loop_ptr, central_freelist->head[level]);
-    int number = move_count(level);
-    while (number-- > 0)
+    int wanted = number;
+    int reclaimed = 0;
+    while (number > 0)
     {
-        // Update span central size
-        loop_ptr = next(loop_ptr);
-        CHECK_HEAP(loop_ptr);
-        Span *span = span_of(loop_ptr); // TODO: span不加锁是否有问题
-        assert(0 <= span->central_size && span->central_size <= PAGE_SIZE);
-        span->central_size -= pow_of2(level);
+        Span *span = central_cache.spans[size_class];
+        if (span == nullptr)
+        {
+            // Before the heap gives a new span, take back objects stranded on remote lists
+            if (!reclaimed++ && reclaim_remote(size_class) > 0)
+                continue;
+            if (alloc_heap(size_class) == 0)
+                break;
+            continue;
+        }
         CHECK_SPAN(*span);
+        if (span->free_count == span_objects(size_class))
+            central_cache.free_spans[size_class]--;
+        __atomic_store_n(&span->owner, thread_id, __ATOMIC_RELAXED);
+        // Central cache is enough for allocating, take what the span has
+        while (number > 0 && span->freelist != nullptr)
+        {
+            uintptr_t object = span->freelist;
+            span->freelist = next(object);
+            span->free_count--;
+            link_ptr(object, freelist->head[size_class]);
+            freelist->head[size_class] = object;
+            freelist->count[size_class]++;
+            number--;
+        }
+        if (span->freelist == nullptr)
+            central_remove(span);
     }
-    move(central_freelist, freelist, level, move_count(level));
+    CHECK_FREELIST(freelist, size_class);
 
-    mutex_unlock(&lock_central[level]);
-    return 1;
+    mutex_unlock(&lock_central[size_class]);
+    return wanted - number;
+}
+
+// Count an allocation of this site, the one that used up the countdown stands
+// for the SAMPLE_INTERVAL bytes before it. The next one is half to one and a
+// half intervals away, so periodic patterns are not always missed
+static void sample_site(ThreadCache *thread_cache, uintptr_t site, size_t size)
+{
+    thread_cache->sample_countdown = SAMPLE_INTERVAL / 2 + RAND() % 32768 * (SAMPLE_INTERVAL / 32768);
+    for (int i = 0; i < SAMPLE_SITES; i++)
+    {
+        SiteSamples *samples = &thread_cache->sites[(site / 4 + i) % SAMPLE_SITES];
+        if (samples->site != site && samples->site != 0)
+            continue;
+        samples->site = site;
+        samples->samples++;
+        samples->bytes += size;
+        return;
+    }
 }
 
 static void *kalloc(size_t size) 
@@ -311,244 +647,231 @@ static void *kalloc(size_t size)
     const size_t level = level_of(size);
     if (level == 0)
     {
-        printf("Allocated memory at NULL\n");
+        debug("Allocated memory at NULL\n");
         return NULL;
     }
     int thread_id = current_thread_id();
     assert(thread_id != -1);
+    ThreadCache *thread_cache = &thread_caches[thread_id];
+    thread_cache->sample_countdown -= size;
+    if (thread_cache->sample_countdown < 0)
+        sample_site(thread_cache, (uintptr_t)__builtin_return_address(0), size);
+    if (level > SMALL_OBJECT_LEVEL)
+        return alloc_large(size, level);
+    int size_class = class_of(size);
+    ClassStats *stats = &thread_cache->stats[size_class];
+    stats->allocs++;
 
     // Thread cache is enough for allocating
-    ThreadCache *thread_cache = &thread_caches[thread_id];
     FreeList *freelist = &thread_cache->freelist;
-    if (freelist->head[level] == nullptr)
+    if (freelist->head[size_class] != nullptr)
+        stats->hits++;
+    else
+        stats->misses++;
+    if (freelist->head[size_class] == nullptr && alloc_remote(size_class) == 0)
     {
-        int result = alloc_central(level);
+        // Slow start: one more object at each transfer up to a batch, then a batch more each time
+        int batch = move_count(size_class);
+        int max_length = freelist->max_length[size_class];
+        int number = max_length < batch ? max_length : batch;
+        int result = alloc_central(size_class, number < 1 ? 1 : number);
         if (result == 0)
         {
-            printf("Allocated memory at NULL\n");
+            debug("Allocated memory at NULL\n");
             return nullptr;
         }
+        stats->refills++;
+        if (max_length < batch)
+            freelist->max_length[size_class]++;
+        else if (max_length < MAX_LIST_LENGTH)
+            freelist->max_length[size_class] += batch;
     }
-    assert(freelist->head[level] != nullptr);
+    assert(freelist->head[size_class] != nullptr);
 
-    uintptr_t alloc_start = freelist->head[level];
-    freelist->head[level] = next(freelist->head[level]);
-    freelist->count[level]--;
-    CHECK_FREELIST(freelist, level);
-    printf("Allocated memory at %p, span id: %d\n", (void *)alloc_start, span_idx(alloc_start));
-
-    // Use shadow memory to check validation
-    mutex_lock(&lock_shadow);
-    unsigned char *shadow_start = addr2shadow(alloc_start);
-    uintptr_t alloc_end = alloc_start + pow_of2(level);
-    CHECK_HEAP(alloc_start);
-    CHECK_HEAP(alloc_end);
-    unsigned char *shadow_end = addr2shadow(alloc_end);
-    for (unsigned char *ptr = shadow_start; ptr < shadow_end; ptr++)
-        assert((*ptr) == 0);
-    memset(shadow_start, 0xff, pow_of2(level) / 8);
-    mutex_unlock(&lock_shadow);
+    uintptr_t alloc_start = freelist->head[size_class];
+    freelist->head[size_class] = next(freelist->head[size_class]);
+    freelist->count[size_class]--;
+    CHECK_FREELIST(freelist, size_class);
+    debug("Allocated memory at %p, span id: %d\n", (void *)alloc_start, span_idx(alloc_start));
+    check_shadow(alloc_start, class_size(size_class), 0);
 
     return (void *)alloc_start;
 }
 
-void free2heap(int level)
-{
-    mutex_lock(&lock_heap);
-    // If central cache is oversized, return memory to heap
-    int CENTRAL_THREASHOLD = 4;
-    int free_span_count = 0;
-    for (int i = 0; i < SPAN_NUM; i++)
-    {
-        if (spans[i].central_size == PAGE_SIZE)
-        {
-            if (free_span_count < CENTRAL_THREASHOLD)
-            {
-                free_span_count++;
-            }
-            else
-            {
-                FreeList *central_freelist = &central_cache.freelist;
-                int level = spans[i].level;
-                uintptr_t dummy_head;
-                uintptr_t dummy_ptr = (uintptr_t)&dummy_head;
-                uintptr_t loop_ptr = dummy_ptr;
-                link_ptr(loop_ptr, central_freelist->head[level]);
-                // Clean up current span's memory in level
-                int freed_count = 0;
-                while (loop_ptr != nullptr)
-                {
-                    uintptr_t next_ptr = next(loop_ptr);
-                    if (next_ptr != nullptr && span_idx(next_ptr) == i)
-                    {
-                        freed_count++;
-                        link_ptr(loop_ptr, next(next_ptr));
-                    }
-                    else
-                    {
-                        loop_ptr = next(loop_ptr);
-                    }
-                }
-                assert(freed_count == move_count(level));
-                central_freelist->count[level] -= freed_count;
-                central_freelist->head[level] = next(dummy_ptr);
-                CHECK_FREELIST(central_freelist, level);
-                // Return memory to heap
-                assert(spans[i].status == IN_USE && spans[i].central_size == PAGE_SIZE);
-                spans[i].status = ON_HEAP;
-                spans[i].central_size = 0;
-                spans[i].level = 0;
-                printf("span id: %d, status: ON_HEAP\n", i);
-                uintptr_t span_addr = heap_start() + PAGE_SIZE * i;
-                link_ptr(span_addr, heap_head);
-                heap_head = span_addr;
-            }
-        }
-    }
-    mutex_unlock(&lock_heap);
-}
-
-void free2central(int level)
+void free2central(int size_class)
 {
     int thread_id = current_thread_id();
     ThreadCache *thread_cache = &thread_caches[thread_id];
     FreeList *freelist = &thread_cache->freelist;
 
-    mutex_lock(&lock_central[level]);
-
-    int LOCAL_THREASHOLD = 2 * move_count(level);
-    if (freelist->count[level] < LOCAL_THREASHOLD)
+    // The list keeps overflowing, it is longer than this thread needs
+    int batch = move_count(size_class);
+    if (freelist->max_length[size_class] < batch)
+        freelist->max_length[size_class]++;
+    else if (freelist->max_length[size_class] > batch && ++freelist->overages[size_class] > MAX_OVERAGES)
     {
-        mutex_unlock(&lock_central[level]);
-        return;
+        // Never below a batch, or a refill would ask for nothing
+        freelist->max_length[size_class] -= batch;
+        if (freelist->max_length[size_class] < batch)
+            freelist->max_length[size_class] = batch;
+        freelist->overages[size_class] = 0;
     }
 
-    // If local cache is oversized, move freelist to central_freelist
-    FreeList *central_freelist = &central_cache.freelist;
-    move(freelist, central_freelist, level, move_count(level));
-    // update span central size
-    uintptr_t dummy_memory;
-    uintptr_t loop_ptr = (uintptr_t)&dummy_memory;
-    link_ptr(loop_ptr, central_freelist->head[level]);
-    int number = move_count(level);
-    while (number-- > 0)
+    // Cut a batch off the local list before taking the lock
+    int number = freelist->count[size_class] < batch ? freelist->count[size_class] : batch;
+    uintptr_t head = freelist->head[size_class];
+    uintptr_t tail = head;
+    for (int i = 1; i < number; i++)
+        tail = next(tail);
+    freelist->head[size_class] = next(tail);
+    freelist->count[size_class] -= number;
+    link_ptr(tail, nullptr);
+    CHECK_FREELIST(freelist, size_class);
+
+    mutex_lock(&lock_central[size_class]);
+
+    // What other threads freed to this one goes back too, it has more than it needs
+    uintptr_t remote = __atomic_exchange_n(&thread_cache->remote[size_class], nullptr, __ATOMIC_ACQUIRE);
+    thread_cache->stats[size_class].remote_taken += free2spans(size_class, remote);
+
+    // A full batch goes to the transfer cache as it is
+    if (number == batch && central_cache.batch_count[size_class] < transfer_slots(size_class))
     {
-        loop_ptr = next(loop_ptr);
-        CHECK_HEAP(loop_ptr);
-        Span *span = span_of(loop_ptr);
-        assert(0 <= span->central_size && span->central_size <= PAGE_SIZE);
-        span->central_size += pow_of2(level);
-        CHECK_SPAN(*span);
+        central_cache.batches[size_class][central_cache.batch_count[size_class]++] = head;
+        mutex_unlock(&lock_central[size_class]);
+        return;
     }
 
-    free2heap(level);
-    mutex_unlock(&lock_central[level]);
+    // Transfer cache is full, move objects back to the freelists of their spans
+    free2spans(size_class, head);
+
+    mutex_unlock(&lock_central[size_class]);
+}
+
+// Free memory: another thread's object -> its owner's remote list
+static void free2remote(int owner, int size_class, uintptr_t object)
+{
+    uintptr_t *remote = &thread_caches[owner].remote[size_class];
+    uintptr_t head = __atomic_load_n(remote, __ATOMIC_RELAXED);
+    do
+        link_ptr(object, head);
+    while (!__atomic_compare_exchange_n(remote, &head, object, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void free_large(Span *span)
+{
+    int thread_id = current_thread_id();
+    if (thread_id != -1)
+        thread_caches[thread_id].stats[0].frees++;
+    debug("Free large memory at: %p, pages: %d\n", (void *)span_addr(span), span->npages);
+    check_shadow(span_addr(span), span->npages * PAGE_SIZE, 0xff);
+    mutex_lock(&lock_heap);
+    heap_free_pages(span);
+    mutex_unlock(&lock_heap);
+}
+
+void free_pages(void *ptr)
+{
+    uintptr_t ptr_addr = (uintptr_t)ptr;
+    Span *span = span_of(ptr_addr);
+    assert(span->status == LARGE && span_addr(span) == ptr_addr);
+    free_large(span);
 }
 
 static void kfree(void *ptr) 
 {
     uintptr_t ptr_addr = (uintptr_t)ptr;
     Span* span = span_of(ptr_addr);
-    int level = span->level;
-    printf("Free memory at: %p, size: %x, span id: %d\n", ptr, pow_of2(level), span_idx(ptr_addr));
+    if (span->status == LARGE)
+    {
+        assert(span_addr(span) == ptr_addr);
+        free_large(span);
+        return;
+    }
+    int size_class = span->size_class;
+    debug("Free memory at: %p, size: %x, span id: %d\n", ptr, (int)class_size(size_class), span_idx(ptr_addr));
     assert(span->status == IN_USE);
     int thread_id = current_thread_id();
     assert(thread_id != -1);
+    ClassStats *stats = &thread_caches[thread_id].stats[size_class];
+    stats->frees++;
+    check_shadow(ptr_addr, class_size(size_class), 0xff);
 
-    // Use shadow memory to check validation
-    mutex_lock(&lock_shadow);
-    unsigned char *shadow_start = addr2shadow(ptr_addr);
-    uintptr_t free_end = ptr_addr + pow_of2(level);
-    CHECK_HEAP(ptr_addr);
-    CHECK_HEAP(free_end);
-    unsigned char *shadow_end = addr2shadow(free_end);
-    for (unsigned char *ptr = shadow_start; ptr < shadow_end; ptr++)
-        assert((*ptr) == 0xff);
-    memset(shadow_start, 0x0, pow_of2(level) / 8);
-    mutex_unlock(&lock_shadow);
+    // Objects of spans another thread owns go back to it, without taking any lock
+    int owner = __atomic_load_n(&span->owner, __ATOMIC_RELAXED);
+    if (owner != thread_id)
+    {
+        stats->remote_frees++;
+        free2remote(owner, size_class, ptr_addr);
+        return;
+    }
 
     ThreadCache *thread_cache = &thread_caches[thread_id];
     FreeList *freelist = &thread_cache->freelist;
-    link_ptr(ptr_addr, freelist->head[level]);
-    freelist->head[level] = ptr_addr;
-    freelist->count[level]++;
-    CHECK_FREELIST(freelist, level);
-
-    free2central(level);
-
-    // // If local cache is oversized, move freelist to central_freelist
-    // int LOCAL_THREASHOLD = 2 * move_count(level);
-    // if (freelist->count[level] >= LOCAL_THREASHOLD)
-    // {
-    //     mutex_lock(&lock_central[level]);
-    //     FreeList *central_freelist = &central_cache.freelist;
-    //     move(freelist, central_freelist, level, move_count(level));
-    //     // update span central size
-    //     uintptr_t dummy_memory;
-    //     uintptr_t loop_ptr = (uintptr_t)&dummy_memory;
-    //     link_ptr(loop_ptr, central_freelist->head[level]);
-    //     int number = move_count(level);
-    //     while (number-- > 0)
-    //     {
-    //         loop_ptr = next(loop_ptr);
-    //         CHECK_HEAP(loop_ptr);
-    //         Span *span = span_of(loop_ptr);
-    //         assert(0 <= span->central_size && span->central_size <= PAGE_SIZE);
-    //         span->central_size += pow_of2(level);
-    //         CHECK_SPAN(*span);
-    //     }
-        
-    //     // If central cache is oversized, return memory to heap
-    //     int CENTRAL_THREASHOLD = 4;
-    //     int free_span_count = 0;
-    //     for (int i = 0; i < SPAN_NUM; i++)
-    //     {
-    //         if (spans[i].central_size == PAGE_SIZE)
-    //         {
-    //             if (free_span_count < CENTRAL_THREASHOLD)
-    //             {
-    //                 free_span_count++;
-    //             }
-    //             else
-    //             {
-    //                 int level = spans[i].level;
-    //                 uintptr_t dummy_head;
-    //                 uintptr_t dummy_ptr = (uintptr_t)&dummy_head;
-    //                 loop_ptr = dummy_ptr;
-    //                 link_ptr(loop_ptr, central_freelist->head[level]);
-    //                 // Clean up current span's memory in level
-    //                 int freed_count = 0;
-    //                 while (loop_ptr != nullptr)
-    //                 {
-    //                     uintptr_t next_ptr = next(loop_ptr);
-    //                     if (next_ptr != nullptr && span_idx(next_ptr) == i)
-    //                     {
-    //                         freed_count++;
-    //                         link_ptr(loop_ptr, next(next_ptr));
-    //                     }
-    //                     else
-    //                     {
-    //                         loop_ptr = next(loop_ptr);
-    //                     }
-    //                 }
-    //                 assert(freed_count == move_count(level));
-    //                 central_freelist->count[level] -= freed_count;
-    //                 central_freelist->head[level] = next(dummy_ptr);
-    //                 CHECK_FREELIST(central_freelist, level);
-    //                 // Return memory to heap
-    //                 assert(spans[i].status == IN_USE && spans[i].central_size == PAGE_SIZE);
-    //                 spans[i].status = ON_HEAP;
-    //                 spans[i].central_size = 0;
-    //                 spans[i].level = 0;
-    //                 printf("span id: %d, status: ON_HEAP\n", i);
-    //                 uintptr_t span_addr = heap_start() + PAGE_SIZE * i;
-    //                 link_ptr(span_addr, heap_head);
-    //                 heap_head = span_addr;
-    //             }
-    //         }
-    //     }
-    //     mutex_unlock(&lock_central[level]);
-    // }
+    link_ptr(ptr_addr, freelist->head[size_class]);
+    freelist->head[size_class] = ptr_addr;
+    freelist->count[size_class]++;
+    CHECK_FREELIST(freelist, size_class);
+
+    // Only an oversized local cache goes to the central cache and takes its lock
+    if (freelist->count[size_class] > freelist->max_length[size_class])
+        free2central(size_class);
+}
+
+// Counters are read while other threads may write them, they are only a snapshot.
+// klib's printf knows neither field widths nor %lu: columns are tab separated
+// and counters printed as int
+void pmm_stats()
+{
+    printf("class\tsize\tallocs\tfrees\thits\tmisses\trefills\tremote\tstranded\tcached\tspans\tbatches\n");
+    for (int size_class = 0; size_class <= MAX_SIZE_CLASS; size_class++)
+    {
+        ClassStats total = {0};
+        int cached = 0;
+        for (int i = 0; i < MAX_THREAD; i++)
+        {
+            ClassStats *stats = &thread_caches[i].stats[size_class];
+            total.allocs += stats->allocs;
+            total.frees += stats->frees;
+            total.hits += stats->hits;
+            total.misses += stats->misses;
+            total.refills += stats->refills;
+            total.remote_frees += stats->remote_frees;
+            total.remote_taken += stats->remote_taken;
+            cached += thread_caches[i].freelist.count[size_class];
+        }
+        if (total.allocs == 0 && total.frees == 0)
+            continue;
+        printf("%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
+            size_class, (int)(size_class == 0 ? 0 : class_size(size_class)), (int)total.allocs, (int)total.frees, (int)total.hits, (int)total.misses,
+            (int)total.refills, (int)total.remote_frees, (int)(total.remote_frees - total.remote_taken), cached, central_cache.spans_in_use[size_class], central_cache.batch_count[size_class]);
+    }
+
+    // Fragmentation: how much of the free memory the biggest free span is
+    int pages = 0, count = 0, largest = 0;
+    mutex_lock(&lock_heap);
+    for (int length = 1; length < PAGE_LISTS; length++)
+    {
+        for (Span *span = free_spans[length]; span != nullptr; span = span->next)
+        {
+            pages += span->npages;
+            count++;
+            largest = span->npages > largest ? span->npages : largest;
+        }
+    }
+    mutex_unlock(&lock_heap);
+    printf("heap: %d of %d pages free in %d spans, largest %d pages\n", pages, (int)SPAN_NUM, count, largest);
+
+    printf("sampled allocation sites, one sample per %d KB:\n", SAMPLE_INTERVAL / 1024);
+    for (int i = 0; i < MAX_THREAD; i++)
+    {
+        for (int j = 0; j < SAMPLE_SITES; j++)
+        {
+            SiteSamples *samples = &thread_caches[i].sites[j];
+            if (samples->site != 0)
+                printf("  cpu %d: %p, %d samples, %d bytes\n", i, (void *)samples->site, (int)samples->samples, (int)samples->bytes);
+        }
+    }
 }
 
 MODULE_DEF(pmm) = {
@@ -1,6 +1,7 @@
 #include <kernel.h>
 #include <thread.h>
 #include <pmm.h>
+#include <time.h>
 
 static void entry(int tid)
 {
@@ -135,6 +136,118 @@ void stress_test_entry(int tid)
     }
 }
 
+// Small objects only, without printing: measures the thread cache fast path
+#define THROUGHPUT_OPS (1 << 22)
+#define THROUGHPUT_SLOTS 64
+
+void throughput_test_entry(int tid)
+{
+    void *slots[THROUGHPUT_SLOTS] = {0};
+    unsigned int seed = tid;
+    for (int i = 0; i < THROUGHPUT_OPS; i++)
+    {
+        int slot = rand_r(&seed) % THROUGHPUT_SLOTS;
+        if (slots[slot] == NULL)
+        {
+            size_t size = 8 << (rand_r(&seed) % 7); // 8B - 512B
+            slots[slot] = pmm->alloc(size);
+            assert(slots[slot] != NULL);
+        }
+        else
+        {
+            pmm->free(slots[slot]);
+            slots[slot] = NULL;
+        }
+    }
+    for (int slot = 0; slot < THROUGHPUT_SLOTS; slot++)
+    {
+        if (slots[slot] != NULL)
+            pmm->free(slots[slot]);
+    }
+}
+
+// Objects allocated by one thread and freed by another, like T_produce/T_consume
+// in L2_kmt: odd threads produce, even threads consume
+#define HANDOFF_OPS (1 << 20)
+#define HANDOFF_SLOTS 256
+
+static struct {
+    pthread_mutex_t lock;
+    void *slots[HANDOFF_SLOTS];
+    int head, tail;
+} handoff = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void handoff_test_entry(int tid)
+{
+    unsigned int seed = tid;
+    for (int i = 0; i < HANDOFF_OPS; )
+    {
+        void *ptr = NULL;
+        size_t size = 8 << (rand_r(&seed) % 7); // 8B - 512B
+        if (tid % 2 == 1)
+        {
+            ptr = pmm->alloc(size);
+            assert(ptr != NULL);
+            *(int *)ptr = tid;
+        }
+        pthread_mutex_lock(&handoff.lock);
+        if (tid % 2 == 1 && handoff.tail - handoff.head < HANDOFF_SLOTS)
+        {
+            handoff.slots[handoff.tail++ % HANDOFF_SLOTS] = ptr;
+            ptr = NULL;
+            i++;
+        }
+        else if (tid % 2 == 0 && handoff.tail != handoff.head)
+        {
+            ptr = handoff.slots[handoff.head++ % HANDOFF_SLOTS];
+            i++;
+        }
+        pthread_mutex_unlock(&handoff.lock);
+        if (ptr != NULL)
+        {
+            assert(tid % 2 == 1 || *(int *)ptr % 2 == 1);
+            pmm->free(ptr);
+        }
+        if (tid % 2 == 1 ? ptr != NULL : ptr == NULL)
+            sched_yield(); // full or empty, let the other side run
+    }
+}
+
+// Whole pages at their alignment, like the page tables of vme
+#define PAGES_OPS (1 << 16)
+#define PAGES_SLOTS 64
+
+void pages_test_entry(int tid)
+{
+    void *slots[PAGES_SLOTS] = {0};
+    int npages[PAGES_SLOTS];
+    unsigned int seed = tid;
+    for (int i = 0; i < PAGES_OPS; i++)
+    {
+        int slot = rand_r(&seed) % PAGES_SLOTS;
+        if (slots[slot] == NULL)
+        {
+            npages[slot] = 1 + rand_r(&seed) % 16;
+            size_t align = (size_t)PAGE_SIZE << (rand_r(&seed) % 5); // 4KB - 64KB
+            slots[slot] = alloc_pages(npages[slot], align);
+            assert(slots[slot] != NULL && ((uintptr_t)slots[slot] & (align - 1)) == 0);
+            memset(slots[slot], tid, (size_t)npages[slot] * PAGE_SIZE);
+        }
+        else
+        {
+            char *last = (char *)slots[slot] + (size_t)npages[slot] * PAGE_SIZE - 1;
+            assert(*(char *)slots[slot] == (char)tid && *last == (char)tid);
+            free_pages(slots[slot]);
+            slots[slot] = NULL;
+        }
+    }
+    for (int slot = 0; slot < PAGES_SLOTS; slot++)
+    {
+        if (slots[slot] != NULL)
+            free_pages(slots[slot]);
+    }
+}
+
 static void create_test(void *entry, size_t thread_count)
 {
     for (int i = 0; i < thread_count; i++)
@@ -167,6 +280,44 @@ int main(int argc, char *argv[])
         create_test(stress_test_entry, 8);
         printf("~End stress test.\n");
         break;
+    case 3:
+    {
+        int thread_count = argc > 2 ? atoi(argv[2]) : 4;
+        printf("~Begin throughput test.\n");
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        create_test(throughput_test_entry, thread_count);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%d threads: %.1f Mops/s\n", thread_count, (double)thread_count * THROUGHPUT_OPS / seconds / 1e6);
+        printf("~End throughput test.\n");
+        break;
+    }
+    case 4:
+    {
+        int thread_count = argc > 2 ? atoi(argv[2]) & ~1 : 4;
+        printf("~Begin handoff test.\n");
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        create_test(handoff_test_entry, thread_count);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%d threads: %.1f Mops/s\n", thread_count, (double)thread_count * HANDOFF_OPS / seconds / 1e6);
+        printf("~End handoff test.\n");
+        break;
+    }
+    case 5:
+        printf("~Begin pages test.\n");
+        create_test(pages_test_entry, 4);
+        printf("~End pages test.\n");
+        break;
+    case 6:
+        printf("~Begin stats test.\n");
+        create_test(throughput_test_entry, 2);
+        create_test(handoff_test_entry, 2);
+        pmm_stats();
+        printf("~End stats test.\n");
+        break;
     default:
         break;
     }
@@ -6,6 +6,13 @@
 #define ALIGN_UP(value, alignment) (((value) + (alignment) - 1) & ~((alignment) - 1))
 #define ALIGN_DOWN(value, alignment) ((value) & ~((alignment) - 1))
 
+// Tracing only exists with PMM_DEBUG, kalloc/kfree print nothing otherwise
+#ifdef PMM_DEBUG
+#define debug(...) printf(__VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
 // ~Begin global variables
 static spinlock_t lk_central[MAX_OBJECT_LEVEL + 1];
 static spinlock_t lk_heap;
@@ -206,7 +213,7 @@ static int alloc_heap(int level)
     span->status = IN_USE;
     span->central_size = PAGE_SIZE;
     span->level = level;
-    printf("span: %d, status: IN_USE\n", span_idx(alloc_addr));
+    debug("span: %d, status: IN_USE\n", span_idx(alloc_addr));
     heap_head = next(heap_head);
     FreeList *central_freelist = &central_cache.freelist;
     for (uintptr_t loop_ptr = alloc_addr; loop_ptr < alloc_addr + PAGE_SIZE; loop_ptr += pow_of2(level))
@@ -283,7 +290,7 @@ static void *kalloc(size_t size)
     const size_t level = level_of(size);
     if (level == 0)
     {
-        printf("Allocated memory at NULL\n");
+        debug("Allocated memory at NULL\n");
         return NULL;
     }
     int thread_id = current_thread_id();
@@ -297,7 +304,7 @@ static void *kalloc(size_t size)
         int result = alloc_central(level);
         if (result == 0)
         {
-            printf("Allocated memory at NULL\n");
+            debug("Allocated memory at NULL\n");
             return nullptr;
         }
     }
@@ -307,7 +314,7 @@ static void *kalloc(size_t size)
     freelist->head[level] = next(freelist->head[level]);
     freelist->count[level]--;
     CHECK_FREELIST(freelist, level);
-    printf("Allocated memory at %p, span id: %d\n", (void *)alloc_start, span_idx(alloc_start));
+    debug("Allocated memory at %p, span id: %d\n", (void *)alloc_start, span_idx(alloc_start));
 
     // Use shadow memory to check validation
     kmt->spin_lock(&lk_shadow);
@@ -371,7 +378,7 @@ void free2heap(int level)
                 spans[i].status = ON_HEAP;
                 spans[i].central_size = 0;
                 spans[i].level = 0;
-                printf("span id: %d, status: ON_HEAP\n", i);
+                debug("span id: %d, status: ON_HEAP\n", i);
                 uintptr_t span_addr = heap_start() + PAGE_SIZE * i;
                 link_ptr(span_addr, heap_head);
                 heap_head = span_addr;
@@ -426,7 +433,7 @@ static void kfree(void *ptr)
     uintptr_t ptr_addr = (uintptr_t)ptr;
     Span* span = span_of(ptr_addr);
     int level = span->level;
-    printf("Free memory at: %p, size: %x, span id: %d\n", ptr, pow_of2(level), span_idx(ptr_addr));
+    debug("Free memory at: %p, size: %x, span id: %d\n", ptr, pow_of2(level), span_idx(ptr_addr));
     assert(span->status == IN_USE);
     int thread_id = current_thread_id();
     assert(thread_id != -1);
@@ -1,57 +1,551 @@
 // Original Author: Andrej Karpathy
 // https://github.com/karpathy/llm.c
 
+#define _GNU_SOURCE // cpu_set_t and thread affinity
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#ifdef MMAP_CHECKPOINT
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
 #include "thread.h"
 #include "thread-sync.h"
 
-#define BUFFER_SIZE 768
-#define THREAD_NUM 16
+#define THREAD_NUM 63 // at most this many workers, the pool sizes itself to the machine
+#define MAX_NODES 8 // NUMA nodes the weights are replicated on, at most
+#define NUMA_REGIONS 6 // the 5 matmul weight tensors, and their packed copy
+#define DEQUE_SIZE 64 // power of 2, a deque never holds more than log2(n) ranges
+#define POOL_SPIN 64  // sched_yield()s before an idle worker goes to sleep
 
+// the work of a parallel_for is passed around as plain [begin, end) ranges of
+// iteration indices, the function and its argument are shared by the whole job
 typedef struct {
-    void (*function)(void* arg);
+    atomic_int begin, end;
+} Range;
+
+// Chase-Lev work-stealing deque: the owner pushes and takes at the bottom,
+// every other thread steals from the top
+typedef struct {
+    atomic_long top __attribute__((aligned(64)));
+    atomic_long bottom __attribute__((aligned(64)));
+    Range ranges[DEQUE_SIZE];
+} Deque;
+
+typedef struct {
+    void (*function)(void* arg, int begin, int end);
     void* arg;
-} Task;
+    int grain; // ranges of at most this many iterations are not split further
+    atomic_int remaining; // latch: iterations not finished yet
+} Job;
 
 typedef struct {
-    Task tasks[BUFFER_SIZE];
-    int count;
-    int front;
-    int rear;
-    int finished;
+    Deque deques[THREAD_NUM + 1]; // deques[0] belongs to the main thread
+    Job job; // the job being run, there is at most one at a time
+    atomic_int epoch; // bumped for every new job
     mutex_t mutex;
-    mutex_t finished_mutex;
-    cond_t producer;
-    cond_t consumer;
-    cond_t task_finish;
-} TaskQueue;
-
-TaskQueue task_queue = {
-    .count = 0,
-    .front = 0,
-    .rear = 0,
-    .finished = 0,
+    cond_t wakeup;
+    int num_workers; // threads besides the main thread, see pool_init_topology
+    int cpus[THREAD_NUM + 1]; // the cpu each participant is pinned to, or -1
+    int nodes[THREAD_NUM + 1]; // the NUMA node of that cpu
+} ThreadPool;
+
+ThreadPool pool = {
     .mutex = MUTEX_INIT(),
-    .finished_mutex = MUTEX_INIT(),
-    .producer = COND_INIT(),
-    .consumer = COND_INIT(),
-    .task_finish = COND_INIT()
+    .wakeup = COND_INIT()
 };
 
-Task dequeue_task();
-void enqueue_task(Task task);
+void parallel_for(void (*function)(void* arg, int begin, int end), void* arg, int n, int grain);
+void gelu_forward(float* out, float* inp, int N);
+
+// ----------------------------------------------------------------------------
+// topology: the pool gets one participant per physical core the process may run
+// on, each pinned to its core, and on a NUMA machine every node gets its own copy
+// of the weights (numa_replicate), so the matmuls mostly read local memory
+
+static _Thread_local int pool_node = 0; // NUMA node of the calling participant
+
+static struct {
+    int num_nodes;
+    int num_regions;
+    struct {
+        char* base; // the replicated memory, and its size
+        size_t size;
+        char* replicas[MAX_NODES];
+    } regions[NUMA_REGIONS];
+} numa = {.num_nodes = 1};
+
+// parse a sysfs cpu list such as "0-3,8,10-11" into set, returns 0 if it can't be read
+static int read_cpulist(const char* path, cpu_set_t* set) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) { return 0; }
+    CPU_ZERO(set);
+    int first, last;
+    while (fscanf(f, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%d", &last) != 1) { break; }
+            c = fgetc(f);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) { CPU_SET(cpu, set); }
+        if (c != ',') { break; }
+    }
+    fclose(f);
+    return 1;
+}
+
+static void pin_to_cpu(int cpu) {
+    if (cpu < 0) { return; }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// decide the participants of the pool: the first hardware thread of every
+// physical core in the process's affinity mask, grouped by NUMA node
+void pool_init_topology() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        // no affinity to work with: size the pool by the online cpus, unpinned
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.num_workers = online > THREAD_NUM + 1 ? THREAD_NUM : (online > 1 ? online - 1 : 0);
+        for (int id = 0; id <= pool.num_workers; id++) { pool.cpus[id] = -1; pool.nodes[id] = 0; }
+        return;
+    }
+
+    static int node_of[CPU_SETSIZE];
+    cpu_set_t node_cpus;
+    char path[128];
+    for (int node = 0; node < MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (!read_cpulist(path, &node_cpus)) { continue; }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_cpus)) { node_of[cpu] = node; }
+        }
+    }
+
+    // drop the SMT siblings of cpus already taken, they share the core's FMA units
+    cpu_set_t cores = allowed, siblings;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &cores)) { continue; }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if (!read_cpulist(path, &siblings)) { continue; }
+        for (int other = cpu + 1; other < CPU_SETSIZE; other++) {
+            if (CPU_ISSET(other, &siblings)) { CPU_CLR(other, &cores); }
+        }
+    }
+
+    int n = 0;
+    int used[MAX_NODES] = {0};
+    for (int node = 0; node < MAX_NODES; node++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && n <= THREAD_NUM; cpu++) {
+            if (CPU_ISSET(cpu, &cores) && node_of[cpu] == node) {
+                pool.cpus[n] = cpu;
+                pool.nodes[n] = node;
+                used[node] = 1;
+                n++;
+            }
+        }
+    }
+    pool.num_workers = n > 0 ? n - 1 : 0;
+    if (n == 0) { pool.cpus[0] = -1; pool.nodes[0] = 0; }
+    numa.num_nodes = 0;
+    for (int node = 0; node < MAX_NODES; node++) {
+        if (used[node]) { numa.num_nodes = node + 1; }
+    }
+    if (numa.num_nodes == 0) { numa.num_nodes = 1; }
+
+    pin_to_cpu(pool.cpus[0]);
+    pool_node = pool.nodes[0];
+}
+
+// give every NUMA node its own copy of the size bytes at base. each copy is
+// made by the main thread while it runs on that node, so it is first touched,
+// and so allocated, there. does nothing on a single node machine
+void numa_replicate(void* base, size_t size) {
+    if (numa.num_nodes <= 1 || numa.num_regions == NUMA_REGIONS) { return; }
+    int r = numa.num_regions++;
+    numa.regions[r].base = (char*)base;
+    numa.regions[r].size = size;
+    for (int node = 0; node < numa.num_nodes; node++) {
+        int id = 0;
+        while (id <= pool.num_workers && pool.nodes[id] != node) { id++; }
+        if (id > pool.num_workers) { numa.regions[r].replicas[node] = NULL; continue; }
+        pin_to_cpu(pool.cpus[id]);
+        numa.regions[r].replicas[node] = (char*)malloc(size);
+        memcpy(numa.regions[r].replicas[node], base, size);
+    }
+    pin_to_cpu(pool.cpus[0]);
+}
+
+void numa_free() {
+    for (int r = 0; r < numa.num_regions; r++) {
+        for (int node = 0; node < MAX_NODES; node++) {
+            free(numa.regions[r].replicas[node]);
+            numa.regions[r].replicas[node] = NULL;
+        }
+    }
+    numa.num_regions = 0;
+}
+
+// p, or the same address in the calling participant's own copy if p is replicated
+static inline void* numa_local(void* p) {
+    char* c = (char*)p;
+    for (int r = 0; r < numa.num_regions; r++) {
+        char* base = numa.regions[r].base;
+        if (c >= base && c < base + numa.regions[r].size) {
+            char* replica = numa.regions[r].replicas[pool_node];
+            return replica != NULL ? replica + (c - base) : p;
+        }
+    }
+    return p;
+}
+
+// ----------------------------------------------------------------------------
+// profiling, compiled in with -DPROFILE: the wall time of every op in every
+// layer, the GFLOP/s of every matmul shape, and how busy each participant of
+// the thread pool was. profile_report() prints it all to stderr at exit
+
+enum { OP_ENCODER, OP_LAYERNORM, OP_QKV, OP_ATTENTION, OP_ATTPROJ, OP_RESIDUAL, OP_FC,
+       OP_GELU, OP_FCPROJ, OP_LNF, OP_LOGITS, OP_SOFTMAX, NUM_OPS };
+
+#ifdef PROFILE
+#define PROFILE_LAYERS 64 // layers beyond this are added to the last one
+#define PROFILE_SHAPES 32
+
+static const char* op_names[NUM_OPS] = {
+    "encoder", "layernorm", "qkv", "attention", "attproj", "residual", "fc",
+    "gelu", "fcproj", "lnf", "logits", "softmax"
+};
+
+typedef struct {
+    int C, OC, q8;
+    long calls, flops, ns;
+} MatmulShape;
+
+typedef struct {
+    _Alignas(64) long busy_ns; // inside job functions
+    long tasks; // ranges run
+    long steals; // ranges stolen from another deque
+    long misses; // sched_yield()s because there was nothing to steal
+} WorkerProfile;
+
+static struct {
+    long start_ns;
+    long op_ns[PROFILE_LAYERS][NUM_OPS];
+    long op_calls[NUM_OPS];
+    MatmulShape shapes[PROFILE_SHAPES];
+    int num_shapes;
+    WorkerProfile workers[THREAD_NUM + 1];
+} profile;
+
+static long profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// charge the time since t0 to op of layer (-1 outside the layers), returns the time now
+static long profile_op(int layer, int op, long t0) {
+    long now = profile_now();
+    if (layer < 0) { layer = 0; }
+    if (layer >= PROFILE_LAYERS) { layer = PROFILE_LAYERS - 1; }
+    profile.op_ns[layer][op] += now - t0;
+    profile.op_calls[op]++;
+    return now;
+}
+
+static void profile_matmul(int BT, int C, int OC, int q8, long t0) {
+    long ns = profile_now() - t0;
+    int i = 0;
+    while (i < profile.num_shapes &&
+           !(profile.shapes[i].C == C && profile.shapes[i].OC == OC && profile.shapes[i].q8 == q8)) {
+        i++;
+    }
+    if (i == PROFILE_SHAPES) { return; }
+    if (i == profile.num_shapes) {
+        profile.shapes[i] = (MatmulShape){.C = C, .OC = OC, .q8 = q8};
+        profile.num_shapes++;
+    }
+    profile.shapes[i].calls++;
+    profile.shapes[i].flops += 2L * BT * C * OC;
+    profile.shapes[i].ns += ns;
+}
+
+static void profile_report() {
+    double wall = (profile_now() - profile.start_ns) / 1e9;
+    fprintf(stderr, "\n%-10s %10s %8s %12s\n", "op", "calls", "ms", "ms/layer max");
+    for (int op = 0; op < NUM_OPS; op++) {
+        long total = 0, max = 0;
+        for (int l = 0; l < PROFILE_LAYERS; l++) {
+            total += profile.op_ns[l][op];
+            if (profile.op_ns[l][op] > max) { max = profile.op_ns[l][op]; }
+        }
+        if (profile.op_calls[op] == 0) { continue; }
+        fprintf(stderr, "%-10s %10ld %8.1f %12.1f\n", op_names[op], profile.op_calls[op], total / 1e6, max / 1e6);
+    }
+    fprintf(stderr, "(the decoder fuses layernorm into qkv and fc, gelu into fc and residual into attproj and fcproj)\n");
+
+    fprintf(stderr, "\nper layer ms:\n%-6s", "layer");
+    for (int op = OP_LAYERNORM; op <= OP_FCPROJ; op++) { fprintf(stderr, " %9s", op_names[op]); }
+    fprintf(stderr, "\n");
+    for (int l = 0; l < PROFILE_LAYERS; l++) {
+        long total = 0;
+        for (int op = OP_LAYERNORM; op <= OP_FCPROJ; op++) { total += profile.op_ns[l][op]; }
+        if (total == 0) { continue; }
+        fprintf(stderr, "%-6d", l);
+        for (int op = OP_LAYERNORM; op <= OP_FCPROJ; op++) { fprintf(stderr, " %9.1f", profile.op_ns[l][op] / 1e6); }
+        fprintf(stderr, "\n");
+    }
+
+    fprintf(stderr, "\n%-6s %-6s %-4s %8s %10s %10s\n", "C", "OC", "q8", "calls", "ms", "GFLOP/s");
+    for (int i = 0; i < profile.num_shapes; i++) {
+        MatmulShape* m = &profile.shapes[i];
+        fprintf(stderr, "%-6d %-6d %-4s %8ld %10.1f %10.2f\n", m->C, m->OC, m->q8 ? "yes" : "no",
+                m->calls, m->ns / 1e6, m->ns > 0 ? (double)m->flops / m->ns : 0.0);
+    }
+
+    fprintf(stderr, "\n%-6s %8s %8s %10s %10s %10s\n", "thread", "busy %", "idle s", "tasks", "steals", "misses");
+    for (int id = 0; id <= pool.num_workers; id++) {
+        WorkerProfile* w = &profile.workers[id];
+        double busy = w->busy_ns / 1e9;
+        fprintf(stderr, "%-6d %8.1f %8.2f %10ld %10ld %10ld\n", id, 100.0 * busy / wall, wall - busy,
+                w->tasks, w->steals, w->misses);
+    }
+    fprintf(stderr, "(thread 0 is the main thread, wall time %.2f s)\n", wall);
+}
+
+#define PROFILE_START() long profile_t0 = profile_now()
+#define PROFILE_OP(layer, op) (profile_t0 = profile_op(layer, op, profile_t0))
+#define PROFILE_MATMUL(BT, C, OC, q8) profile_matmul(BT, C, OC, q8, profile_t0)
+#else
+#define PROFILE_START()
+#define PROFILE_OP(layer, op)
+#define PROFILE_MATMUL(BT, C, OC, q8)
+#endif
+
+// ----------------------------------------------------------------------------
+// vectorized math for the elementwise and normalization layers. like the
+// matmul kernels, the AVX2 versions are picked at runtime and plain C is the
+// fallback. the AVX2 exp is a polynomial approximation: measured against
+// double precision exp over [-87, 88] its relative error stays below 2e-7,
+// and the gelu built on it is within 1e-6 (absolute, |x| < 10) of the tanhf one
+
+static int cpu_has_avx2() {
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        has_avx2 = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    }
+    return has_avx2;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2,fma")))
+
+static inline AVX2 float hsum_avx2(__m256 v) {
+    __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_movehdup_ps(x));
+    return _mm_cvtss_f32(x);
+}
+
+static inline AVX2 float hmax_avx2(__m256 v) {
+    __m128 x = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_max_ss(x, _mm_movehdup_ps(x));
+    return _mm_cvtss_f32(x);
+}
+
+static inline AVX2 __m256 exp_avx2(__m256 x) {
+    // exp(x) = 2^n * exp(r) with n = round(x / ln2) and |r| <= ln2/2, where
+    // exp(r) is a degree 7 polynomial (the cephes expf coefficients). ln2 is
+    // split in two so that r is exact. x is clamped to where 2^n is a normal
+    // float, so large negative inputs give ~1e-38 rather than 0
+    x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+    x = _mm256_max_ps(x, _mm256_set1_ps(-87.3365478515625f));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                               _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+static AVX2 void gelu_avx2(float* out, float* inp, int N) {
+    // 0.5 * x * (1 + tanh(u)) == x / (1 + exp(-2u)), which needs a single exp
+    __m256 k = _mm256_set1_ps(-2.0f * sqrtf(2.0f / M_PI));
+    __m256 k3 = _mm256_set1_ps(-2.0f * sqrtf(2.0f / M_PI) * 0.044715f);
+    __m256 one = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= N; i += 8) {
+        __m256 x = _mm256_loadu_ps(inp + i);
+        __m256 u = _mm256_mul_ps(x, _mm256_fmadd_ps(_mm256_mul_ps(x, x), k3, k)); // -2u
+        _mm256_storeu_ps(out + i, _mm256_div_ps(x, _mm256_add_ps(one, exp_avx2(u))));
+    }
+    for (; i < N; i++) {
+        float x = inp[i];
+        float u = x * (x * x * (-2.0f * sqrtf(2.0f / M_PI) * 0.044715f) - 2.0f * sqrtf(2.0f / M_PI));
+        out[i] = x / (1.0f + expf(u));
+    }
+}
+
+static AVX2 float softmax_exp_avx2(float* probs, float* logits, int n, float maxval) {
+    // probs = exp(logits - maxval), returns their sum
+    __m256 m = _mm256_set1_ps(maxval);
+    __m256 sum = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 e = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(logits + i), m));
+        _mm256_storeu_ps(probs + i, e);
+        sum = _mm256_add_ps(sum, e);
+    }
+    float total = hsum_avx2(sum);
+    for (; i < n; i++) {
+        probs[i] = expf(logits[i] - maxval);
+        total += probs[i];
+    }
+    return total;
+}
+
+static AVX2 float max_avx2(float* x, int n) {
+    __m256 m = _mm256_set1_ps(-INFINITY);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        m = _mm256_max_ps(m, _mm256_loadu_ps(x + i));
+    }
+    float maxval = hmax_avx2(m);
+    for (; i < n; i++) {
+        maxval = fmaxf(maxval, x[i]);
+    }
+    return maxval;
+}
+
+static AVX2 void scale_avx2(float* x, int n, float scale) {
+    __m256 s = _mm256_set1_ps(scale);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), s));
+    }
+    for (; i < n; i++) {
+        x[i] *= scale;
+    }
+}
+
+static AVX2 void layernorm_stats_avx2(float* x, int C, float* mean, float* sqdev) {
+    // the mean of x and the sum of the squared deviations from it
+    // Welford's update in each of the 8 lanes, which then see the same count,
+    // merged pairwise with Chan et al.'s formula for two equal-sized sets
+    __m256 m = _mm256_setzero_ps();
+    __m256 m2 = _mm256_setzero_ps();
+    int k = 0;
+    for (; 8 * (k + 1) <= C; k++) {
+        __m256 v = _mm256_loadu_ps(x + 8 * k);
+        __m256 delta = _mm256_sub_ps(v, m);
+        m = _mm256_fmadd_ps(delta, _mm256_set1_ps(1.0f / (k + 1)), m);
+        m2 = _mm256_fmadd_ps(delta, _mm256_sub_ps(v, m), m2);
+    }
+    float lm[8], lm2[8];
+    _mm256_storeu_ps(lm, m);
+    _mm256_storeu_ps(lm2, m2);
+    float n = k;
+    for (int lanes = 8; lanes > 1; lanes /= 2) {
+        for (int i = 0; i < lanes / 2; i++) {
+            float delta = lm[i + lanes / 2] - lm[i];
+            lm[i] += 0.5f * delta;
+            lm2[i] += lm2[i + lanes / 2] + delta * delta * 0.5f * n;
+        }
+        n *= 2;
+    }
+    // the remaining C % 8 values, one at a time
+    float mv = lm[0], m2v = lm2[0];
+    for (int i = 8 * k; i < C; i++) {
+        n += 1;
+        float delta = x[i] - mv;
+        mv += delta / n;
+        m2v += delta * (x[i] - mv);
+    }
+    *mean = mv;
+    *sqdev = m2v;
+}
+
+static AVX2 void layernorm_apply_avx2(float* out, float* x, int n, float m, float s,
+                                      float* weight, float* bias) {
+    __m256 mv = _mm256_set1_ps(m);
+    __m256 sv = _mm256_set1_ps(s);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 norm = _mm256_mul_ps(sv, _mm256_sub_ps(_mm256_loadu_ps(x + i), mv));
+        _mm256_storeu_ps(out + i, _mm256_fmadd_ps(norm, _mm256_loadu_ps(weight + i), _mm256_loadu_ps(bias + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = (s * (x[i] - m)) * weight[i] + bias[i];
+    }
+}
+#endif
+
+// the mean and the rstd (reciprocal standard deviation) of a row of C values,
+// in a single pass with Welford's algorithm
+static void layernorm_stats(float* x, int C, float* mean, float* rstd) {
+    float eps = 1e-5f;
+    float m = 0.0f, m2 = 0.0f;
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) {
+        layernorm_stats_avx2(x, C, &m, &m2);
+    } else
+#endif
+    for (int i = 0; i < C; i++) {
+        float delta = x[i] - m;
+        m += delta / (i + 1);
+        m2 += delta * (x[i] - m);
+    }
+    *mean = m;
+    *rstd = 1.0f / sqrtf(m2 / C + eps);
+}
+
+// out = (x - m) * s * weight + bias for n values
+static void layernorm_apply(float* out, float* x, int n, float m, float s, float* weight, float* bias) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) {
+        layernorm_apply_avx2(out, x, n, m, s, weight, bias);
+        return;
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+        float norm = (s * (x[i] - m)); // normalize
+        out[i] = norm * weight[i] + bias[i]; // scale and shift
+    }
+}
 
 // ----------------------------------------------------------------------------
 // all the individual layers' forward passes
 // B = batch_size, T = sequence_length, C = channels, V = vocab_size
 
+#define QK 32 // number of values sharing one scale in the Q8_0 format
+
 void encoder_forward(float* out,
                    int* inp, float* wte, float* wpe,
                    int B, int T, int C) {
@@ -77,72 +571,513 @@ void encoder_forward(float* out,
     }
 }
 
+void encoder_forward_q8(float* out,
+                        int* inp, int8_t* wte_q, float* wte_d, float* wpe,
+                        int B, int T, int C) {
+    // encoder_forward for a Q8_0 wte: (V, C) int8 values with one scale per QK of them
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            float* out_bt = out + b * T * C + t * C;
+            int ix = inp[b * T + t];
+            int8_t* wte_ix = wte_q + (size_t)ix * C;
+            float* d_ix = wte_d + (size_t)ix * (C / QK);
+            float* wpe_t = wpe + t * C;
+            for (int i = 0; i < C; i++) {
+                out_bt[i] = wte_ix[i] * d_ix[i / QK] + wpe_t[i];
+            }
+        }
+    }
+}
+
 void layernorm_forward(float* out, float* mean, float* rstd,
                        float* inp, float* weight, float* bias,
                        int B, int T, int C) {
     // reference: https://pytorch.org/docs/stable/generated/torch.nn.LayerNorm.html
     // both inp and out are (B,T,C) of the activations
-    // mean and rstd are (B,T) buffers, to be used later in backward pass
+    // mean and rstd are (B,T) buffers, to be used later in backward pass,
+    // they can be NULL when there is no backward pass
     // at each position (b,t) of the input, the C-dimensional vector
     // of activations gets normalized, then scaled and shifted
-    float eps = 1e-5f;
     for (int b = 0; b < B; b++) {
         for (int t = 0; t < T; t++) {
             // seek to the input position inp[b,t,:]
             float* x = inp + b * T * C + t * C;
-            // calculate the mean
-            float m = 0.0f;
+            // calculate the mean and the rstd (without any bias correction)
+            float m, s;
+            layernorm_stats(x, C, &m, &s);
+            // seek to the output position in out[b,t,:]
+            float* out_bt = out + b * T * C + t * C;
+            layernorm_apply(out_bt, x, C, m, s, weight, bias);
+            // cache the mean and rstd for the backward pass later
+            if (mean != NULL) { mean[b * T + t] = m; }
+            if (rstd != NULL) { rstd[b * T + t] = s; }
+        }
+    }
+}
+
+// matmul kernels: compute out[r, o] = bias[o] + inp[r, :] . weight[o, :] for
+// `rows` consecutive rows of inp and the output channels o_begin <= o < o_end.
+// weight stays in its row-major (OC, C) layout, so every output is a dot
+// product along C and the kernels vectorize along C
+#define MATMUL_TILE_ROWS 4
+
+typedef void (*matmul_kernel_t)(float* out, float* inp, float* weight, float* bias,
+                                int rows, int C, int OC, int o_begin, int o_end);
+
+void matmul_kernel_scalar(float* out, float* inp, float* weight, float* bias,
+                          int rows, int C, int OC, int o_begin, int o_end) {
+    for (int r = 0; r < rows; r++) {
+        float* out_r = out + r * OC;
+        float* inp_r = inp + r * C;
+        for (int o = o_begin; o < o_end; o++) {
+            float val = (bias != NULL) ? bias[o] : 0.0f;
+            float* wrow = weight + o*C;
             for (int i = 0; i < C; i++) {
-                m += x[i];
+                val += inp_r[i] * wrow[i];
             }
-            m = m/C;
-            // calculate the variance (without any bias correction)
-            float v = 0.0f;
-            for (int i = 0; i < C; i++) {
-                float xshift = x[i] - m;
-                v += xshift * xshift;
+            out_r[o] = val;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline AVX2 float dot_avx2(float* a, float* b, int C) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= C; i += 8) {
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc);
+    }
+    float val = hsum_avx2(acc);
+    for (; i < C; i++) { val += a[i] * b[i]; }
+    return val;
+}
+
+// 4 rows x 2 output channels: 8 accumulators, 6 loads per 8 FMAs
+static inline AVX2 void matmul_tile_4x2_avx2(float* out, float* inp, float* weight, float* bias,
+                                             int C, int OC, int o) {
+    float* w0 = weight + o * C;
+    float* w1 = w0 + C;
+    __m256 acc[MATMUL_TILE_ROWS][2];
+    for (int r = 0; r < MATMUL_TILE_ROWS; r++) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    int i = 0;
+    for (; i + 8 <= C; i += 8) {
+        __m256 a = _mm256_loadu_ps(w0 + i);
+        __m256 b = _mm256_loadu_ps(w1 + i);
+        for (int r = 0; r < MATMUL_TILE_ROWS; r++) {
+            __m256 x = _mm256_loadu_ps(inp + r * C + i);
+            acc[r][0] = _mm256_fmadd_ps(x, a, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(x, b, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < MATMUL_TILE_ROWS; r++) {
+        float v0 = hsum_avx2(acc[r][0]), v1 = hsum_avx2(acc[r][1]);
+        for (int j = i; j < C; j++) {
+            v0 += inp[r * C + j] * w0[j];
+            v1 += inp[r * C + j] * w1[j];
+        }
+        out[r * OC + o] = v0 + ((bias != NULL) ? bias[o] : 0.0f);
+        out[r * OC + o + 1] = v1 + ((bias != NULL) ? bias[o + 1] : 0.0f);
+    }
+}
+
+// 1 row x 8 output channels: enough independent FMA chains to hide latency
+// when there are not 4 rows left to share the weight loads with
+static inline AVX2 void matmul_tile_1x8_avx2(float* out, float* inp, float* weight, float* bias,
+                                             int C, int OC, int o) {
+    __m256 acc[8];
+    for (int j = 0; j < 8; j++) { acc[j] = _mm256_setzero_ps(); }
+    int i = 0;
+    for (; i + 8 <= C; i += 8) {
+        __m256 x = _mm256_loadu_ps(inp + i);
+        for (int j = 0; j < 8; j++) {
+            acc[j] = _mm256_fmadd_ps(x, _mm256_loadu_ps(weight + (o + j) * C + i), acc[j]);
+        }
+    }
+    for (int j = 0; j < 8; j++) {
+        float val = hsum_avx2(acc[j]);
+        for (int k = i; k < C; k++) { val += inp[k] * weight[(o + j) * C + k]; }
+        out[o + j] = val + ((bias != NULL) ? bias[o + j] : 0.0f);
+    }
+}
+
+AVX2 void matmul_kernel_avx2(float* out, float* inp, float* weight, float* bias,
+                             int rows, int C, int OC, int o_begin, int o_end) {
+    int r = 0;
+    for (; r + MATMUL_TILE_ROWS <= rows; r += MATMUL_TILE_ROWS) {
+        int o = o_begin;
+        for (; o + 2 <= o_end; o += 2) {
+            matmul_tile_4x2_avx2(out + r * OC, inp + r * C, weight, bias, C, OC, o);
+        }
+        for (; o < o_end; o++) {
+            for (int rr = r; rr < r + MATMUL_TILE_ROWS; rr++) {
+                out[rr * OC + o] = dot_avx2(inp + rr * C, weight + o * C, C) + ((bias != NULL) ? bias[o] : 0.0f);
+            }
+        }
+    }
+    for (; r < rows; r++) {
+        int o = o_begin;
+        for (; o + 8 <= o_end; o += 8) {
+            matmul_tile_1x8_avx2(out + r * OC, inp + r * C, weight, bias, C, OC, o);
+        }
+        for (; o < o_end; o++) {
+            out[r * OC + o] = dot_avx2(inp + r * C, weight + o * C, C) + ((bias != NULL) ? bias[o] : 0.0f);
+        }
+    }
+}
+#endif
+
+// the same kernels for weights packed by pack_weights: panel p holds the output
+// channels 16p..16p+15 as a (C, MATMUL_PANEL) block, so a kernel reads each
+// panel front to back while it computes MATMUL_PANEL outputs at once as a sum
+// of outer products. o_begin and o_end must be multiples of MATMUL_PANEL, or OC
+#define MATMUL_PANEL 16
+
+// pack the row-major (OC, C) weight into OC / MATMUL_PANEL panels
+void pack_weights(float* packed, float* weight, int C, int OC) {
+    for (int p = 0; p < OC / MATMUL_PANEL; p++) {
+        float* panel = packed + (size_t)p * C * MATMUL_PANEL;
+        for (int i = 0; i < C; i++) {
+            for (int j = 0; j < MATMUL_PANEL; j++) {
+                panel[i * MATMUL_PANEL + j] = weight[(size_t)(p * MATMUL_PANEL + j) * C + i];
+            }
+        }
+    }
+}
+
+void matmul_packed_kernel_scalar(float* out, float* inp, float* packed, float* bias,
+                                 int rows, int C, int OC, int o_begin, int o_end) {
+    for (int r = 0; r < rows; r++) {
+        float* out_r = out + r * OC;
+        float* inp_r = inp + r * C;
+        for (int o = o_begin; o < o_end; o += MATMUL_PANEL) {
+            float* panel = packed + (size_t)(o / MATMUL_PANEL) * C * MATMUL_PANEL;
+            float val[MATMUL_PANEL];
+            for (int j = 0; j < MATMUL_PANEL; j++) {
+                val[j] = (bias != NULL) ? bias[o + j] : 0.0f;
             }
-            v = v/C;
-            // calculate the rstd (reciprocal standard deviation)
-            float s = 1.0f / sqrtf(v + eps);
-            // seek to the output position in out[b,t,:]
-            float* out_bt = out + b * T * C + t * C;
             for (int i = 0; i < C; i++) {
-                float n = (s * (x[i] - m)); // normalize
-                float o = n * weight[i] + bias[i]; // scale and shift
-                out_bt[i] = o; // write
+                for (int j = 0; j < MATMUL_PANEL; j++) {
+                    val[j] += inp_r[i] * panel[i * MATMUL_PANEL + j];
+                }
             }
-            // cache the mean and rstd for the backward pass later
-            mean[b * T + t] = m;
-            rstd[b * T + t] = s;
+            for (int j = 0; j < MATMUL_PANEL; j++) {
+                out_r[o + j] = val[j];
+            }
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 4 rows x 16 output channels: 8 accumulators, 2 loads and 4 broadcasts per 8 FMAs
+static inline AVX2 void matmul_packed_tile_4x16_avx2(float* out, float* inp, float* panel, float* bias,
+                                                     int C, int OC, int o) {
+    __m256 acc[MATMUL_TILE_ROWS][2];
+    for (int r = 0; r < MATMUL_TILE_ROWS; r++) {
+        acc[r][0] = _mm256_setzero_ps();
+        acc[r][1] = _mm256_setzero_ps();
+    }
+    for (int i = 0; i < C; i++) {
+        __m256 a = _mm256_loadu_ps(panel + i * MATMUL_PANEL);
+        __m256 b = _mm256_loadu_ps(panel + i * MATMUL_PANEL + 8);
+        for (int r = 0; r < MATMUL_TILE_ROWS; r++) {
+            __m256 x = _mm256_broadcast_ss(inp + r * C + i);
+            acc[r][0] = _mm256_fmadd_ps(x, a, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(x, b, acc[r][1]);
+        }
+    }
+    __m256 bias0 = bias != NULL ? _mm256_loadu_ps(bias + o) : _mm256_setzero_ps();
+    __m256 bias1 = bias != NULL ? _mm256_loadu_ps(bias + o + 8) : _mm256_setzero_ps();
+    for (int r = 0; r < MATMUL_TILE_ROWS; r++) {
+        _mm256_storeu_ps(out + r * OC + o, _mm256_add_ps(acc[r][0], bias0));
+        _mm256_storeu_ps(out + r * OC + o + 8, _mm256_add_ps(acc[r][1], bias1));
+    }
+}
+
+// 1 row x 16 output channels: C is split 4 ways into independent FMA chains
+// instead of rows, to hide the FMA latency
+static inline AVX2 void matmul_packed_tile_1x16_avx2(float* out, float* inp, float* panel, float* bias,
+                                                     int C, int o) {
+    __m256 acc[4][2];
+    for (int k = 0; k < 4; k++) {
+        acc[k][0] = _mm256_setzero_ps();
+        acc[k][1] = _mm256_setzero_ps();
+    }
+    int i = 0;
+    for (; i + 4 <= C; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            __m256 x = _mm256_broadcast_ss(inp + i + k);
+            acc[k][0] = _mm256_fmadd_ps(x, _mm256_loadu_ps(panel + (i + k) * MATMUL_PANEL), acc[k][0]);
+            acc[k][1] = _mm256_fmadd_ps(x, _mm256_loadu_ps(panel + (i + k) * MATMUL_PANEL + 8), acc[k][1]);
+        }
+    }
+    for (; i < C; i++) {
+        __m256 x = _mm256_broadcast_ss(inp + i);
+        acc[0][0] = _mm256_fmadd_ps(x, _mm256_loadu_ps(panel + i * MATMUL_PANEL), acc[0][0]);
+        acc[0][1] = _mm256_fmadd_ps(x, _mm256_loadu_ps(panel + i * MATMUL_PANEL + 8), acc[0][1]);
+    }
+    __m256 v0 = _mm256_add_ps(_mm256_add_ps(acc[0][0], acc[1][0]), _mm256_add_ps(acc[2][0], acc[3][0]));
+    __m256 v1 = _mm256_add_ps(_mm256_add_ps(acc[0][1], acc[1][1]), _mm256_add_ps(acc[2][1], acc[3][1]));
+    if (bias != NULL) {
+        v0 = _mm256_add_ps(v0, _mm256_loadu_ps(bias + o));
+        v1 = _mm256_add_ps(v1, _mm256_loadu_ps(bias + o + 8));
+    }
+    _mm256_storeu_ps(out + o, v0);
+    _mm256_storeu_ps(out + o + 8, v1);
+}
+
+AVX2 void matmul_packed_kernel_avx2(float* out, float* inp, float* packed, float* bias,
+                                    int rows, int C, int OC, int o_begin, int o_end) {
+    for (int o = o_begin; o < o_end; o += MATMUL_PANEL) {
+        float* panel = packed + (size_t)(o / MATMUL_PANEL) * C * MATMUL_PANEL;
+        int r = 0;
+        for (; r + MATMUL_TILE_ROWS <= rows; r += MATMUL_TILE_ROWS) {
+            matmul_packed_tile_4x16_avx2(out + r * OC, inp + r * C, panel, bias, C, OC, o);
+        }
+        for (; r < rows; r++) {
+            matmul_packed_tile_1x16_avx2(out + r * OC, inp + r * C, panel, bias, C, o);
+        }
+    }
+}
+#endif
+
+// Q8_0 quantized matmul kernels: the weights and the inputs are both quantized
+// in blocks of QK consecutive values along C, each block having one float scale,
+// so out[r, o] = bias[o] + sum over blocks of wscale * iscale * (int8 dot product)
+
+typedef void (*matmul_q8_kernel_t)(float* out, int8_t* qinp, float* iscale,
+                                   int8_t* qweight, float* wscale, float* bias,
+                                   int rows, int C, int OC, int o_begin, int o_end);
+
+void matmul_q8_kernel_scalar(float* out, int8_t* qinp, float* iscale,
+                             int8_t* qweight, float* wscale, float* bias,
+                             int rows, int C, int OC, int o_begin, int o_end) {
+    int nb = C / QK;
+    for (int r = 0; r < rows; r++) {
+        int8_t* x = qinp + r * C;
+        float* dx = iscale + r * nb;
+        for (int o = o_begin; o < o_end; o++) {
+            int8_t* w = qweight + o * C;
+            float* dw = wscale + o * nb;
+            float val = (bias != NULL) ? bias[o] : 0.0f;
+            for (int b = 0; b < nb; b++) {
+                int sum = 0;
+                for (int i = b * QK; i < (b + 1) * QK; i++) {
+                    sum += w[i] * x[i];
+                }
+                val += dw[b] * dx[b] * sum;
+            }
+            out[r * OC + o] = val;
         }
     }
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// 8 partial int32 sums of the 32 int8 products x * w, as floats. maddubs wants
+// an unsigned and a signed operand, so the sign of w is moved over to x
+static inline AVX2 __m256 dot_q8_avx2(__m256i x, __m256i w) {
+    __m256i dot16 = _mm256_maddubs_epi16(_mm256_sign_epi8(w, w), _mm256_sign_epi8(x, w));
+    return _mm256_cvtepi32_ps(_mm256_madd_epi16(dot16, _mm256_set1_epi16(1)));
+}
+
+// 1 row x n output channels, n is a constant after inlining
+static inline AVX2 void matmul_q8_tile_avx2(float* out, int8_t* x, float* dx,
+                                            int8_t* qweight, float* wscale, float* bias,
+                                            int C, int o, int n) {
+    int nb = C / QK;
+    __m256 acc[4];
+    for (int j = 0; j < n; j++) { acc[j] = _mm256_setzero_ps(); }
+    for (int b = 0; b < nb; b++) {
+        __m256i xb = _mm256_loadu_si256((__m256i*)(x + b * QK));
+        for (int j = 0; j < n; j++) {
+            __m256i wb = _mm256_loadu_si256((__m256i*)(qweight + (o + j) * C + b * QK));
+            __m256 d = _mm256_set1_ps(wscale[(o + j) * nb + b] * dx[b]);
+            acc[j] = _mm256_fmadd_ps(d, dot_q8_avx2(xb, wb), acc[j]);
+        }
+    }
+    for (int j = 0; j < n; j++) {
+        out[o + j] = hsum_avx2(acc[j]) + ((bias != NULL) ? bias[o + j] : 0.0f);
+    }
+}
+
+AVX2 void matmul_q8_kernel_avx2(float* out, int8_t* qinp, float* iscale,
+                                int8_t* qweight, float* wscale, float* bias,
+                                int rows, int C, int OC, int o_begin, int o_end) {
+    int nb = C / QK;
+    for (int r = 0; r < rows; r++) {
+        int o = o_begin;
+        for (; o + 4 <= o_end; o += 4) {
+            matmul_q8_tile_avx2(out + r * OC, qinp + r * C, iscale + r * nb, qweight, wscale, bias, C, o, 4);
+        }
+        for (; o < o_end; o++) {
+            matmul_q8_tile_avx2(out + r * OC, qinp + r * C, iscale + r * nb, qweight, wscale, bias, C, o, 1);
+        }
+    }
+}
+#endif
+
+static matmul_kernel_t matmul_kernel = NULL;
+static matmul_kernel_t matmul_packed_kernel = NULL;
+static matmul_q8_kernel_t matmul_q8_kernel = NULL;
+
+// pick the best kernels the running CPU supports, once
+static void matmul_select_kernels() {
+    if (matmul_kernel == NULL) {
+        matmul_kernel = matmul_kernel_scalar;
+        matmul_packed_kernel = matmul_packed_kernel_scalar;
+        matmul_q8_kernel = matmul_q8_kernel_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        if (cpu_has_avx2()) {
+            matmul_kernel = matmul_kernel_avx2;
+            matmul_packed_kernel = matmul_packed_kernel_avx2;
+            matmul_q8_kernel = matmul_q8_kernel_avx2;
+        }
+#endif
+    }
+}
+
+// matmul_forward is split into 2-D tiles of (rows x cols) outputs. cols is
+// chosen so that a tile's MATMUL_BLOCK_FLOATS weights stay in L2 while the rows
+// stream past them, and consecutive tiles share the same weights. a parallel
+// task then runs at least MATMUL_GRAIN_MACS multiply-adds worth of tiles
+#define MATMUL_BLOCK_FLOATS (32 * 1024)
+#define MATMUL_BLOCK_ROWS 64
+#define MATMUL_GRAIN_MACS (256 * 1024)
+
+// work that is fused into a matmul, so that the matmul's input or output does
+// not make an extra round trip through memory for it:
+// out = gelu?(layernorm?(inp) . weight + bias) + residual?
+typedef struct {
+    float* ln_weight, *ln_bias; // layernorm the input rows with these, if not NULL
+    float* residual; // (B,T,OC) added to the output, if not NULL
+    int gelu; // apply gelu to the output
+    float* ln_out; // (B,T,C) scratch for the normalized input of a fused layernorm
+    int8_t* qinp; float* iscale; // (B,T,C) scratch for the Q8_0 input of matmul_forward_q8
+} MatmulFusion;
+
 typedef struct
 {
     float* out, *inp, *weight, *bias;
-    int t, T, C, OC;
+    int8_t* qinp, *qweight; // Q8_0 operands, with one scale per QK values
+    float* iscale, *wscale;
+    float* residual; // epilogue, see MatmulFusion
+    int gelu;
+    int packed; // weight is packed by pack_weights
+    int BT, C, OC;
+    int rows, cols; // tile shape
+    int row_tiles;
 } MatmulParam;
 
-void matmul_forward_inner(void *_param) {
-    MatmulParam *param = (MatmulParam *)_param;
-    int b = 0;
-    int t = param->t;
-    float* out_bt = param->out + b * param->T * param->OC + t * param->OC;
-    float* inp_bt = param->inp + b * param->T * param->C + t * param->C;
-    for (int o = 0; o < param->OC; o++) {
-        float val = (param->bias != NULL) ? param->bias[o] : 0.0f;
-        float* wrow = param->weight + o*param->C;
-        for (int i = 0; i < param->C; i++) {
-            float factor1 = inp_bt[i];
-            float factor2 = wrow[i];
-            val += factor1 * factor2;
+// set the tile shape of param, returns the number of tiles and the grain
+// that parallel_for should use for them
+static int matmul_partition(MatmulParam* param, int* grain) {
+    int BT = param->BT, C = param->C, OC = param->OC;
+    // no rows (e.g. no outputs to compute logits for) leave no tiles
+    if (BT == 0) {
+        *grain = 1;
+        return 0;
+    }
+    // a tile of packed weights covers whole panels
+    int align = param->packed ? MATMUL_PANEL : 8;
+    param->cols = (MATMUL_BLOCK_FLOATS / C) & ~(align - 1);
+    if (param->cols < align) { param->cols = align; }
+    param->rows = BT < MATMUL_BLOCK_ROWS ? BT : MATMUL_BLOCK_ROWS;
+    param->row_tiles = (BT + param->rows - 1) / param->rows;
+    int tiles = param->row_tiles * ((OC + param->cols - 1) / param->cols);
+
+    // enough tiles per task to amortize the scheduling, but no fewer tasks than threads
+    long tile_macs = (long)param->rows * param->cols * C;
+    *grain = (int)((MATMUL_GRAIN_MACS + tile_macs - 1) / tile_macs);
+    int fair = (tiles + pool.num_workers) / (pool.num_workers + 1);
+    if (*grain > fair) { *grain = fair; }
+    return tiles;
+}
+
+// the rows bt..bt+*rows-1 and the output channels o..*o_end-1 of a tile
+static int matmul_tile(MatmulParam* param, int tile, int* rows, int* o, int* o_end) {
+    int bt = (tile % param->row_tiles) * param->rows;
+    *o = (tile / param->row_tiles) * param->cols;
+    *rows = bt + param->rows < param->BT ? param->rows : param->BT - bt;
+    *o_end = *o + param->cols < param->OC ? *o + param->cols : param->OC;
+    return bt;
+}
+
+// the fused epilogue of a tile, applied right after the kernel wrote it,
+// while it is still in cache
+static void matmul_epilogue(MatmulParam* param, int bt, int rows, int o, int o_end) {
+    int OC = param->OC;
+    if (param->residual == NULL && !param->gelu) { return; }
+    for (int r = bt; r < bt + rows; r++) {
+        float* out_r = param->out + r * OC;
+        if (param->gelu) {
+            gelu_forward(out_r + o, out_r + o, o_end - o);
+        }
+        if (param->residual != NULL) {
+            float* residual_r = param->residual + r * OC;
+            for (int i = o; i < o_end; i++) {
+                out_r[i] += residual_r[i];
+            }
         }
-        out_bt[o] = val;
     }
 }
 
+void matmul_forward_inner(void *_param, int begin, int end) {
+    MatmulParam *param = (MatmulParam *)_param;
+    int C = param->C, OC = param->OC;
+    for (int tile = begin; tile < end; tile++) {
+        int rows, o, o_end;
+        int bt = matmul_tile(param, tile, &rows, &o, &o_end);
+        matmul_kernel_t kernel = param->packed ? matmul_packed_kernel : matmul_kernel;
+        kernel(param->out + bt * OC, param->inp + bt * C,
+               numa_local(param->weight), param->bias, rows, C, OC, o, o_end);
+        matmul_epilogue(param, bt, rows, o, o_end);
+    }
+}
+
+static void matmul_forward_layout(float* out,
+                                  float* inp, float* weight, int packed, float* bias,
+                                  int B, int T, int C, int OC, MatmulFusion* fusion) {
+    // matmul_forward_fused, for a weight that may be packed.
+    // the kernels read every input row once per output tile, so a fused
+    // layernorm is applied once up front into fusion->ln_out rather than per
+    // tile. it saves the caller a pass of its own over the input, and the
+    // normalized rows stay in cache at decoding sizes
+    PROFILE_START();
+    MatmulFusion none = {0};
+    if (fusion == NULL) { fusion = &none; }
+    if (fusion->ln_weight != NULL) {
+        assert(fusion->ln_out != NULL);
+        layernorm_forward(fusion->ln_out, NULL, NULL, inp, fusion->ln_weight, fusion->ln_bias, B, T, C);
+        inp = fusion->ln_out;
+    }
+
+    matmul_select_kernels();
+    MatmulParam param = {.out = out, .inp = inp, .weight = weight, .bias = bias, .packed = packed,
+                         .residual = fusion->residual, .gelu = fusion->gelu, .BT = B * T, .C = C, .OC = OC};
+    int grain;
+    int tiles = matmul_partition(&param, &grain);
+    parallel_for(matmul_forward_inner, &param, tiles, grain);
+    PROFILE_MATMUL(B * T, C, OC, 0);
+}
+
+void matmul_forward_fused(float* out,
+                          float* inp, float* weight, float* bias,
+                          int B, int T, int C, int OC, MatmulFusion* fusion) {
+    // matmul_forward with the work in fusion (which can be NULL) folded in
+    matmul_forward_layout(out, inp, weight, 0, bias, B, T, C, OC, fusion);
+}
+
+void matmul_forward_packed(float* out,
+                           float* inp, float* packed, float* bias,
+                           int B, int T, int C, int OC, MatmulFusion* fusion) {
+    // matmul_forward_fused against a weight packed by pack_weights, OC must be
+    // a multiple of MATMUL_PANEL
+    assert(OC % MATMUL_PANEL == 0);
+    matmul_forward_layout(out, inp, packed, 1, bias, B, T, C, OC, fusion);
+}
+
 void matmul_forward(float* out,
                     float* inp, float* weight, float* bias,
                     int B, int T, int C, int OC) {
@@ -150,27 +1085,82 @@ void matmul_forward(float* out,
     // OC is short for "output channels"
     // inp is (B,T,C), weight is (OC, C), bias is (OC)
     // out will be (B,T,OC)
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            MatmulParam *param = (MatmulParam*)malloc(sizeof(MatmulParam));
-            *param = (MatmulParam){out, inp, weight, bias, t, T, C, OC};
-            Task task = {
-                .function = matmul_forward_inner,
-                .arg = param
-            };
-            enqueue_task(task);
-        }
-    }
-    // wait until all tasks are done
-    mutex_lock(&task_queue.finished_mutex);
-    while (task_queue.finished < T)
-    {
-        cond_wait(&task_queue.task_finish, &task_queue.finished_mutex);
+    // the work is partitioned over both B*T and OC, so even a single token
+    // (B*T == 1) is spread over all the workers
+    matmul_forward_fused(out, inp, weight, bias, B, T, C, OC, NULL);
+}
+
+// quantize n values of x (a multiple of QK) to Q8_0
+void quantize_q8(int8_t* q, float* d, float* x, int n) {
+    for (int b = 0; b < n / QK; b++) {
+        float amax = 0.0f;
+        for (int i = b * QK; i < (b + 1) * QK; i++) {
+            amax = fmaxf(amax, fabsf(x[i]));
+        }
+        float scale = amax / 127.0f;
+        float iscale = scale != 0.0f ? 1.0f / scale : 0.0f;
+        for (int i = b * QK; i < (b + 1) * QK; i++) {
+            q[i] = (int8_t)roundf(x[i] * iscale);
+        }
+        d[b] = scale;
+    }
+}
+
+// layernorm a row of C values of x and quantize the result to Q8_0, a block
+// at a time, so the normalized fp32 row is never written out
+void layernorm_quantize_q8(int8_t* q, float* d, float* x, float* weight, float* bias, int C) {
+    float m, s;
+    layernorm_stats(x, C, &m, &s);
+    float block[QK];
+    for (int b = 0; b < C; b += QK) {
+        layernorm_apply(block, x + b, QK, m, s, weight + b, bias + b);
+        quantize_q8(q + b, d + b / QK, block, QK);
+    }
+}
+
+void matmul_q8_forward_inner(void *_param, int begin, int end) {
+    MatmulParam *param = (MatmulParam *)_param;
+    int C = param->C, OC = param->OC;
+    for (int tile = begin; tile < end; tile++) {
+        int rows, o, o_end;
+        int bt = matmul_tile(param, tile, &rows, &o, &o_end);
+        matmul_q8_kernel(param->out + bt * OC, param->qinp + bt * C, param->iscale + bt * (C / QK),
+                         numa_local(param->qweight), numa_local(param->wscale), param->bias, rows, C, OC, o, o_end);
+        matmul_epilogue(param, bt, rows, o, o_end);
     }
-    // usleep(100* 1000);
-    assert(task_queue.finished == T);
-    task_queue.finished = 0;
-    mutex_unlock(&task_queue.finished_mutex);
+}
+
+void matmul_forward_q8(float* out,
+                       float* inp, int8_t* qweight, float* wscale, float* bias,
+                       int B, int T, int C, int OC, MatmulFusion* fusion) {
+    // matmul_forward_fused against Q8_0 weights: qweight is (OC, C), wscale is (OC, C/QK).
+    // inp is quantized the same way first, so the inner loops are int8 dot products
+    // and the weights are streamed at a quarter of the fp32 bandwidth. a fused
+    // layernorm is applied as part of the quantization. the quantized input
+    // goes to fusion->qinp and fusion->iscale, which cannot be NULL
+    PROFILE_START();
+    size_t n = (size_t)B * T * C;
+    assert(C % QK == 0);
+    assert(fusion != NULL && fusion->qinp != NULL && fusion->iscale != NULL);
+    int8_t* qinp = fusion->qinp;
+    float* iscale = fusion->iscale;
+    if (fusion->ln_weight != NULL) {
+        for (int bt = 0; bt < B * T; bt++) {
+            layernorm_quantize_q8(qinp + (size_t)bt * C, iscale + (size_t)bt * (C / QK), inp + (size_t)bt * C,
+                                  fusion->ln_weight, fusion->ln_bias, C);
+        }
+    } else {
+        quantize_q8(qinp, iscale, inp, n);
+    }
+
+    matmul_select_kernels();
+    MatmulParam param = {.out = out, .qinp = qinp, .iscale = iscale, .qweight = qweight, .wscale = wscale,
+                         .bias = bias, .residual = fusion->residual, .gelu = fusion->gelu,
+                         .BT = B * T, .C = C, .OC = OC};
+    int grain;
+    int tiles = matmul_partition(&param, &grain);
+    parallel_for(matmul_q8_forward_inner, &param, tiles, grain);
+    PROFILE_MATMUL(B * T, C, OC, 1);
 }
 
 // void matmul_forward(float* out,
@@ -196,6 +1186,93 @@ void matmul_forward(float* out,
 //     }
 // }
 
+// attention is parallelized over the independent (b, t, h) rows. a task runs
+// at least ATTENTION_GRAIN_MACS multiply-adds worth of rows
+#define ATTENTION_GRAIN_MACS (64 * 1024)
+
+typedef struct {
+    float* out, *preatt, *att, *inp, *kv;
+    int* slots, *pos; // the kv cache slot and the position of each row, when decoding
+    int B, T, maxT, C, NH;
+} AttentionParam;
+
+static int attention_grain(int rows, int len, int hs) {
+    // len is the average number of positions a row attends to
+    long row_macs = 2L * len * hs;
+    int grain = (int)((ATTENTION_GRAIN_MACS + row_macs - 1) / row_macs);
+    int fair = (rows + pool.num_workers) / (pool.num_workers + 1);
+    return grain < fair ? grain : fair;
+}
+
+void attention_forward_inner(void* _param, int begin, int end) {
+    AttentionParam* param = (AttentionParam*)_param;
+    int T = param->T, C = param->C, NH = param->NH;
+    int C3 = C*3;
+    int hs = C / NH; // head size
+    float scale = 1.0 / sqrtf(hs);
+
+    for (int row = begin; row < end; row++) {
+        // row = (b * T + t) * NH + h
+        int h = row % NH;
+        int t = (row / NH) % T;
+        int b = row / NH / T;
+        float* inp = param->inp;
+        float* query_t = inp + b * T * C3 + t * C3 + h * hs;
+        float* preatt_bth = param->preatt + b*NH*T*T + h*T*T + t*T;
+        float* att_bth = param->att + b*NH*T*T + h*T*T + t*T;
+
+        // pass 1: calculate query dot key and maxval
+        float maxval = -INFINITY;
+        for (int t2 = 0; t2 <= t; t2++) {
+            float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
+
+            // (query_t) dot (key_t2)
+            float val = 0.0f;
+            for (int i = 0; i < hs; i++) {
+                val += query_t[i] * key_t2[i];
+            }
+            val *= scale;
+            if (val > maxval) {
+                maxval = val;
+            }
+
+            preatt_bth[t2] = val;
+        }
+
+        // pass 2: calculate the exp and keep track of sum
+        // maxval is being calculated and subtracted only for numerical stability
+        float expsum = 0.0f;
+        for (int t2 = 0; t2 <= t; t2++) {
+            float expv = expf(preatt_bth[t2] - maxval);
+            expsum += expv;
+            att_bth[t2] = expv;
+        }
+        float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+
+        // pass 3: normalize to get the softmax
+        for (int t2 = 0; t2 < T; t2++) {
+            if (t2 <= t) {
+                att_bth[t2] *= expsum_inv;
+            } else {
+                // causal attention mask. not strictly necessary to set to zero here
+                // only doing this explicitly for debugging and checking to PyTorch
+                att_bth[t2] = 0.0f;
+            }
+        }
+
+        // pass 4: accumulate weighted values into the output of attention
+        float* out_bth = param->out + b * T * C + t * C + h * hs;
+        for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
+        for (int t2 = 0; t2 <= t; t2++) {
+            float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
+            float att_btht2 = att_bth[t2];
+            for (int i = 0; i < hs; i++) {
+                out_bth[i] += att_btht2 * value_t2[i];
+            }
+        }
+    }
+}
+
 void attention_forward(float* out, float* preatt, float* att,
                        float* inp,
                        int B, int T, int C, int NH) {
@@ -206,74 +1283,92 @@ void attention_forward(float* out, float* preatt, float* att,
     // attention is the only layer that mixes information across time
     // every other operation is applied at every (b,t) position independently
     // (and of course, no layer mixes information across batch)
+    AttentionParam param = {out, preatt, att, inp, NULL, NULL, NULL, B, T, T, C, NH};
+    int rows = B * T * NH;
+    parallel_for(attention_forward_inner, &param, rows, attention_grain(rows, (T + 1) / 2, C / NH));
+}
+
+void attention_forward_kv_inner(void* _param, int begin, int end) {
+    AttentionParam* param = (AttentionParam*)_param;
+    int maxT = param->maxT, C = param->C, NH = param->NH;
+    int C2 = C*2;
     int C3 = C*3;
     int hs = C / NH; // head size
     float scale = 1.0 / sqrtf(hs);
 
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            for (int h = 0; h < NH; h++) {
-                float* query_t = inp + b * T * C3 + t * C3 + h * hs;
-                float* preatt_bth = preatt + b*NH*T*T + h*T*T + t*T;
-                float* att_bth = att + b*NH*T*T + h*T*T + t*T;
-
-                // pass 1: calculate query dot key and maxval
-                float maxval = -10000.0f; // TODO something better
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* key_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C; // +C because it's key
-
-                    // (query_t) dot (key_t2)
-                    float val = 0.0f;
-                    for (int i = 0; i < hs; i++) {
-                        val += query_t[i] * key_t2[i];
-                    }
-                    val *= scale;
-                    if (val > maxval) {
-                        maxval = val;
-                    }
-
-                    preatt_bth[t2] = val;
-                }
-
-                // pass 2: calculate the exp and keep track of sum
-                // maxval is being calculated and subtracted only for numerical stability
-                float expsum = 0.0f;
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float expv = expf(preatt_bth[t2] - maxval);
-                    expsum += expv;
-                    att_bth[t2] = expv;
-                }
-                float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
-
-                // pass 3: normalize to get the softmax
-                for (int t2 = 0; t2 < T; t2++) {
-                    if (t2 <= t) {
-                        att_bth[t2] *= expsum_inv;
-                    } else {
-                        // causal attention mask. not strictly necessary to set to zero here
-                        // only doing this explicitly for debugging and checking to PyTorch
-                        att_bth[t2] = 0.0f;
-                    }
-                }
-
-                // pass 4: accumulate weighted values into the output of attention
-                float* out_bth = out + b * T * C + t * C + h * hs;
-                for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
-                for (int t2 = 0; t2 <= t; t2++) {
-                    float* value_t2 = inp + b * T * C3 + t2 * C3 + h * hs + C*2; // +C*2 because it's value
-                    float att_btht2 = att_bth[t2];
-                    for (int i = 0; i < hs; i++) {
-                        out_bth[i] += att_btht2 * value_t2[i];
-                    }
-                }
+    for (int row = begin; row < end; row++) {
+        // row = n * NH + h
+        int h = row % NH;
+        int n = row / NH;
+        int tq = param->pos[n]; // absolute position of the query
+        float* kv = param->kv + (size_t)param->slots[n] * maxT * C2;
+        float* query_t = param->inp + n * C3 + h * hs;
+        float* out_bth = param->out + n * C + h * hs;
+
+        // single pass with an online softmax: the running max, the running sum of
+        // exps and the weighted sum of values are rescaled whenever the max grows,
+        // so the attention scores never have to be written out
+        float maxval = -INFINITY;
+        float expsum = 0.0f;
+        for (int i = 0; i < hs; i++) { out_bth[i] = 0.0f; }
+        for (int t2 = 0; t2 <= tq; t2++) {
+            float* key_t2 = kv + t2 * C2 + h * hs;
+            float* value_t2 = key_t2 + C; // +C because it's value
+            float val = 0.0f;
+            for (int i = 0; i < hs; i++) {
+                val += query_t[i] * key_t2[i];
+            }
+            val *= scale;
+            if (val > maxval) {
+                float correction = expf(maxval - val);
+                expsum *= correction;
+                for (int i = 0; i < hs; i++) { out_bth[i] *= correction; }
+                maxval = val;
+            }
+            float expv = expf(val - maxval);
+            expsum += expv;
+            for (int i = 0; i < hs; i++) {
+                out_bth[i] += expv * value_t2[i];
             }
         }
+        float expsum_inv = expsum == 0.0f ? 0.0f : 1.0f / expsum;
+        for (int i = 0; i < hs; i++) { out_bth[i] *= expsum_inv; }
+    }
+}
+
+void attention_forward_kv(float* out, float* inp, float* kv,
+                          int N, int* slots, int* pos, int maxT, int C, int NH) {
+    // incremental version of attention_forward used during decoding
+    // inp is (N, 3C) holding the Q, K, V vectors of N new tokens, which may belong to
+    // different sequences: row n is position pos[n] of the sequence in slots[n]
+    // kv is this layer's (num_slots, maxT, 2C) cache of the K, V vectors of all positions
+    // output is (N, C)
+    // the K, V slices of inp are first appended to the cache, so that every query
+    // can attend over positions 0..pos[n] of its own sequence, including new tokens
+    // of that sequence in the same call, without recomputing them
+    int C2 = C*2;
+    int C3 = C*3;
+    long len = 0;
+    for (int n = 0; n < N; n++) {
+        float* kv_n = kv + ((size_t)slots[n] * maxT + pos[n]) * C2;
+        memcpy(kv_n, inp + n * C3 + C, C2 * sizeof(float));
+        len += pos[n] + 1;
     }
+
+    AttentionParam param = {out, NULL, NULL, inp, kv, slots, pos, N, 1, maxT, C, NH};
+    int rows = N * NH;
+    parallel_for(attention_forward_kv_inner, &param, rows, attention_grain(rows, (int)(len / N), C / NH));
 }
 
 #define GELU_SCALING_FACTOR sqrtf(2.0f / M_PI)
 void gelu_forward(float* out, float* inp, int N) {
     // (approximate) GeLU elementwise non-linearity in the MLP block of Transformer
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) {
+        gelu_avx2(out, inp, N);
+        return;
+    }
+#endif
     for (int i = 0; i < N; i++) {
         float x = inp[i];
         float cube = 0.044715f * x * x * x;
@@ -287,32 +1382,109 @@ void residual_forward(float* out, float* inp1, float* inp2, int N) {
     }
 }
 
-void softmax_forward(float* probs, float* logits, int B, int T, int V) {
+// softmax is parallelized over chunks of SOFTMAX_CHUNK logits of every row, as
+// V is large. each chunk is exponentiated against its own max first, then the
+// chunk sums are combined and every chunk is rescaled to the row's max and sum
+#define SOFTMAX_CHUNK 4096
+
+typedef struct {
+    float* probs, *logits;
+    int V, chunks; // chunks per row
+    float* chunk_max, *chunk_scale; // (rows, chunks)
+} SoftmaxParam;
+
+static float softmax_max(float* x, int n) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) { return max_avx2(x, n); }
+#endif
+    float maxval = -INFINITY;
+    for (int i = 0; i < n; i++) {
+        maxval = fmaxf(maxval, x[i]);
+    }
+    return maxval;
+}
+
+static float softmax_exp(float* probs, float* logits, int n, float maxval) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) { return softmax_exp_avx2(probs, logits, n, maxval); }
+#endif
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        probs[i] = expf(logits[i] - maxval);
+        sum += probs[i];
+    }
+    return sum;
+}
+
+static void softmax_scale(float* x, int n, float scale) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_avx2()) { scale_avx2(x, n, scale); return; }
+#endif
+    for (int i = 0; i < n; i++) {
+        x[i] *= scale;
+    }
+}
+
+// the logits [begin, end) of chunk c (= row * chunks + chunk index)
+static size_t softmax_chunk(SoftmaxParam* param, int c, int* n) {
+    int V = param->V;
+    int i = (c % param->chunks) * SOFTMAX_CHUNK;
+    *n = i + SOFTMAX_CHUNK < V ? SOFTMAX_CHUNK : V - i;
+    return (size_t)(c / param->chunks) * V + i;
+}
+
+void softmax_exp_inner(void* _param, int begin, int end) {
+    // pass 1: chunk_max <- the max of the chunk, probs <- exp(logits - chunk_max),
+    // chunk_scale <- their sum
+    SoftmaxParam* param = (SoftmaxParam*)_param;
+    for (int c = begin; c < end; c++) {
+        int n;
+        size_t offset = softmax_chunk(param, c, &n);
+        float maxval = softmax_max(param->logits + offset, n);
+        param->chunk_max[c] = maxval;
+        param->chunk_scale[c] = softmax_exp(param->probs + offset, param->logits + offset, n, maxval);
+    }
+}
+
+void softmax_scale_inner(void* _param, int begin, int end) {
+    // pass 2: probs *= chunk_scale
+    SoftmaxParam* param = (SoftmaxParam*)_param;
+    for (int c = begin; c < end; c++) {
+        int n;
+        size_t offset = softmax_chunk(param, c, &n);
+        softmax_scale(param->probs + offset, n, param->chunk_scale[c]);
+    }
+}
+
+void softmax_forward(float* probs, float* logits, float* scratch, int B, int T, int V) {
     // output: probs are (B,T,V) of the probabilities (sums to 1.0 in each b,t position)
     // input: logits is (B,T,V) of the unnormalized log probabilities
-    for (int b = 0; b < B; b++) {
-        for (int t = 0; t < T; t++) {
-            // probs <- softmax(logits)
-            float* logits_bt = logits + b * T * V + t * V;
-            float* probs_bt = probs + b * T * V + t * V;
-
-            // maxval is only calculated and subtracted for numerical stability
-            float maxval = -10000.0f; // TODO something better
-            for (int i = 0; i < V; i++) {
-                if (logits_bt[i] > maxval) {
-                    maxval = logits_bt[i];
-                }
-            }
-            float sum = 0.0f;
-            for (int i = 0; i < V; i++) {
-                probs_bt[i] = expf(logits_bt[i] - maxval);
-                sum += probs_bt[i];
-            }
-            for (int i = 0; i < V; i++) {
-                probs_bt[i] /= sum;
-            }
+    // scratch: (B,T,2*chunks) for the max and the scale of every chunk
+    int rows = B * T;
+    int chunks = (V + SOFTMAX_CHUNK - 1) / SOFTMAX_CHUNK;
+    SoftmaxParam param = {probs, logits, V, chunks, scratch, scratch + (size_t)rows * chunks};
+    parallel_for(softmax_exp_inner, &param, rows * chunks, 1);
+
+    for (int row = 0; row < rows; row++) {
+        // maxval is only calculated and subtracted for numerical stability
+        float* max_r = param.chunk_max + row * chunks;
+        float* scale_r = param.chunk_scale + row * chunks;
+        float maxval = -INFINITY;
+        for (int c = 0; c < chunks; c++) {
+            maxval = fmaxf(maxval, max_r[c]);
+        }
+        float sum = 0.0f;
+        for (int c = 0; c < chunks; c++) {
+            // the chunk's sum was taken against its own max
+            float rescale = expf(max_r[c] - maxval);
+            sum += rescale * scale_r[c];
+            scale_r[c] = rescale;
+        }
+        for (int c = 0; c < chunks; c++) {
+            scale_r[c] /= sum;
         }
     }
+    parallel_for(softmax_scale_inner, &param, rows * chunks, 1);
 }
 
 // ----------------------------------------------------------------------------
@@ -339,29 +1511,117 @@ typedef struct {
     float* lnfb; // (C)
 } ParameterTensors;
 
-// allocate memory for the parameters and point the individual tensors to the right places
-float* malloc_and_point_parameters(ParameterTensors* params, size_t* param_sizes) {
-    size_t num_parameters = 0;
+// version 2 checkpoints store the big matmul weights quantized to Q8_0:
+// their int8 values, followed by one float scale per QK values
+typedef struct {
+    int8_t* q;
+    float* d;
+} Q8Tensor;
+
+typedef struct {
+    Q8Tensor wte; // (V, C)
+    Q8Tensor qkvw; // (L, 3*C, C)
+    Q8Tensor attprojw; // (L, C, C)
+    Q8Tensor fcw; // (L, 4*C, C)
+    Q8Tensor fcprojw; // (L, C, 4*C)
+} QuantizedTensors;
+
+// the matmul weights of the layers of an fp32 model, packed by pack_weights
+typedef struct {
+    float* qkvw; // (L, 3*C / MATMUL_PANEL, C, MATMUL_PANEL)
+    float* attprojw; // (L, C / MATMUL_PANEL, C, MATMUL_PANEL)
+    float* fcw; // (L, 4*C / MATMUL_PANEL, C, MATMUL_PANEL)
+    float* fcprojw; // (L, C / MATMUL_PANEL, 4*C, MATMUL_PANEL)
+} PackedTensors;
+
+// which of the parameter tensors are quantized in a version 2 checkpoint
+static const int q8_parameters[NUM_PARAMETER_TENSORS] = {1, 0, 0, 0, 1, 0, 1, 0, 0, 0, 1, 0, 1, 0, 0, 0};
+
+// the number of bytes all parameters take up in a checkpoint of the given version
+size_t parameters_bytes(size_t* param_sizes, int version) {
+    size_t bytes = 0;
     for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
-        num_parameters += param_sizes[i];
+        if (version == 2 && q8_parameters[i]) {
+            bytes += param_sizes[i] + param_sizes[i] / QK * sizeof(float);
+        } else {
+            bytes += param_sizes[i] * sizeof(float);
+        }
     }
-    // malloc all parameters all at once
-    float* params_memory = (float*)malloc(num_parameters * sizeof(float));
-    // assign all the tensors
+    return bytes;
+}
+
+// point the individual tensors to the right places of a contiguous block of parameters.
+// the fp32 pointer of a quantized tensor is left NULL, and the Q8_0 ones of an fp32 model
+void point_parameters(ParameterTensors* params, QuantizedTensors* qparams,
+                      size_t* param_sizes, int version, void* params_memory) {
     float** ptrs[] = {
         &params->wte, &params->wpe, &params->ln1w, &params->ln1b, &params->qkvw, &params->qkvb,
         &params->attprojw, &params->attprojb, &params->ln2w, &params->ln2b, &params->fcw, &params->fcb,
         &params->fcprojw, &params->fcprojb, &params->lnfw, &params->lnfb
     };
-    float* params_memory_iterator = params_memory;
+    Q8Tensor* qptrs[] = {
+        &qparams->wte, NULL, NULL, NULL, &qparams->qkvw, NULL,
+        &qparams->attprojw, NULL, NULL, NULL, &qparams->fcw, NULL,
+        &qparams->fcprojw, NULL, NULL, NULL
+    };
+    char* params_memory_iterator = (char*)params_memory;
     for (size_t i = 0; i < NUM_PARAMETER_TENSORS; i++) {
-        *(ptrs[i]) = params_memory_iterator;
-        params_memory_iterator += param_sizes[i];
+        if (version == 2 && q8_parameters[i]) {
+            *(ptrs[i]) = NULL;
+            qptrs[i]->q = (int8_t*)params_memory_iterator;
+            qptrs[i]->d = (float*)(params_memory_iterator + param_sizes[i]);
+            params_memory_iterator += param_sizes[i] + param_sizes[i] / QK * sizeof(float);
+        } else {
+            if (qptrs[i] != NULL) {
+                *(qptrs[i]) = (Q8Tensor){NULL, NULL};
+            }
+            *(ptrs[i]) = (float*)params_memory_iterator;
+            params_memory_iterator += param_sizes[i] * sizeof(float);
+        }
     }
+}
+
+// allocate memory for the parameters and point the individual tensors to the right places
+void* malloc_and_point_parameters(ParameterTensors* params, QuantizedTensors* qparams,
+                                  size_t* param_sizes, int version) {
+    // malloc all parameters all at once
+    void* params_memory = malloc(parameters_bytes(param_sizes, version));
+    // assign all the tensors
+    point_parameters(params, qparams, param_sizes, version, params_memory);
     return params_memory;
 }
 
-#define NUM_ACTIVATION_TENSORS 23
+#ifdef MMAP_CHECKPOINT
+// map the whole checkpoint read-only and point the tensors straight into it,
+// right after the header. nothing is copied: pages are faulted in from the page
+// cache on first use and are shared by every process that maps the same file
+void* mmap_and_point_parameters(ParameterTensors* params, QuantizedTensors* qparams,
+                                size_t* param_sizes, int version,
+                                FILE* file, void** mapping, size_t* mapping_size) {
+    size_t header_size = 256 * sizeof(int);
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || (size_t)st.st_size < header_size + parameters_bytes(param_sizes, version)) {
+        return NULL;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    // the weights are streamed front to back on every forward pass, so start
+    // reading them in the background right away
+    madvise(base, st.st_size, MADV_WILLNEED);
+#ifdef MMAP_HUGEPAGE
+    madvise(base, st.st_size, MADV_HUGEPAGE);
+#endif
+    *mapping = base;
+    *mapping_size = st.st_size;
+    void* params_memory = (char*)base + header_size;
+    point_parameters(params, qparams, param_sizes, version, params_memory);
+    return params_memory;
+}
+#endif
+
+#define NUM_ACTIVATION_TENSORS 24
 typedef struct {
     float* encoded; // (B, T, C)
     float* ln1; // (L, B, T, C)
@@ -386,28 +1646,45 @@ typedef struct {
     float* logits; // (B, T, V)
     float* probs; // (B, T, V)
     float* losses; // (B, T)
+    float* softmax_scratch; // (B, T, 2 * chunks) the max and the scale of each SOFTMAX_CHUNK of logits
 } ActivationTensors;
 
-float* malloc_and_point_activations(ActivationTensors* acts, size_t* act_sizes) {
-    size_t num_activations = 0;
-    for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
-        num_activations += act_sizes[i];
-    }
-    float* acts_memory = (float*)malloc(num_activations * sizeof(float));
+// point the individual tensors into an already allocated arena of activations
+void point_activations(ActivationTensors* acts, size_t* act_sizes, float* acts_memory) {
     float** ptrs[] = {
         &acts->encoded, &acts->ln1, &acts->ln1_mean, &acts->ln1_rstd, &acts->qkv, &acts->atty,
         &acts->preatt, &acts->att, &acts->attproj, &acts->residual2, &acts->ln2, &acts->ln2_mean,
         &acts->ln2_rstd, &acts->fch, &acts->fch_gelu, &acts->fcproj, &acts->residual3, &acts->lnf,
-        &acts->lnf_mean, &acts->lnf_rstd, &acts->logits, &acts->probs, &acts->losses
+        &acts->lnf_mean, &acts->lnf_rstd, &acts->logits, &acts->probs, &acts->losses, &acts->softmax_scratch
     };
     float* acts_memory_iterator = acts_memory;
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
         *(ptrs[i]) = acts_memory_iterator;
         acts_memory_iterator += act_sizes[i];
     }
-    return acts_memory;
 }
 
+// the activations gpt2_decode needs, as inference never runs backward: two
+// ping-pong residual streams plus one scratch buffer per kind of layer, shared
+// by all the layers, and logits only for the rows that are sampled from.
+// the N rows are the new tokens of all the sequences decoded together.
+// the layernorms, gelu and residual adds are fused into the matmuls, see
+// MatmulFusion, so they need no buffers of their own beyond the scratch the
+// matmuls share
+#define NUM_INFERENCE_TENSORS 9
+typedef struct {
+    float* residual; // (N, C) residual stream going into each layer
+    float* residual2; // (N, C) residual stream after each attention block
+    float* lnf; // (num_outputs, C)
+    float* qkv; // (N, 3*C)
+    float* atty; // (N, C)
+    float* fch; // (N, 4*C) after gelu
+    float* logits; // (num_outputs, V)
+    float* ln; // (N, C) layernormed input of the fp32 matmuls, see MatmulFusion
+    float* iscale; // (N, 4*C/QK) scales of qinp
+    int8_t* qinp; // (N, 4*C) Q8_0 input of the quantized matmuls, the widest is fcproj's
+} InferenceTensors;
+
 typedef struct {
     int max_seq_len; // max sequence length, e.g. 1024
     int vocab_size; // vocab size, e.g. 50257
@@ -421,7 +1698,14 @@ typedef struct {
     // the weights (parameters) of the model, and their sizes
     ParameterTensors params;
     size_t param_sizes[NUM_PARAMETER_TENSORS];
-    float* params_memory;
+    QuantizedTensors qparams; // the Q8_0 weights of a version 2 checkpoint
+    void* params_memory;
+    void* params_mapping; // the mmap of the checkpoint params_memory points into, or NULL
+    size_t params_mapping_size;
+    PackedTensors packed; // all NULL unless the weights were packed, see gpt2_pack_weights
+    float* packed_memory;
+    void* packed_mapping; // the mmap of the sidecar file packed_memory points into, or NULL
+    size_t packed_mapping_size;
     int num_parameters;
     // gradients of the weights
     ParameterTensors grads;
@@ -433,6 +1717,7 @@ typedef struct {
     ActivationTensors acts;
     size_t act_sizes[NUM_ACTIVATION_TENSORS];
     float* acts_memory;
+    size_t acts_capacity; // number of floats allocated in acts_memory
     int num_activations;
     // gradients of the activations
     ActivationTensors grads_acts;
@@ -441,29 +1726,27 @@ typedef struct {
     int batch_size; // the batch size (B) of current forward pass
     int seq_len; // the sequence length (T) of current forward pass
     int* inputs; // the input tokens for the current forward pass
+    size_t inputs_capacity; // number of ints allocated in inputs
     int* targets; // the target tokens for the current forward pass
     float mean_loss; // after a forward pass with targets, will be populated with the mean loss
+    // key/value cache for incremental decoding
+    float* kv_cache; // (L, num_slots, maxT, 2*C), one slot per sequence decoded at once
+    int kv_slots; // the number of slots the cache was allocated for
+    // the activations of gpt2_decode, and the arena they are pointed into
+    InferenceTensors infer;
+    float* infer_memory;
+    size_t infer_capacity; // number of floats allocated in infer_memory
 } GPT2;
 
-void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
-
-    // read in model from a checkpoint file
-    FILE *model_file = fopen(checkpoint_path, "rb");
-    if (model_file == NULL) { printf("Error opening model file\n"); exit(1); }
-    int model_header[256];
-    fread(model_header, sizeof(int), 256, model_file);
-    if (model_header[0] != 20240326) { printf("Bad magic model file"); exit(1); }
-    if (model_header[1] != 1) { printf("Bad version in model file"); exit(1); }
+// set up the model for config, up to (but not including) its parameters
+void gpt2_init(GPT2 *model, GPT2Config config) {
+    int maxT = config.max_seq_len;
+    int V = config.vocab_size;
+    int L = config.num_layers;
+    int C = config.channels;
+    model->config = config;
 
-    // read in hyperparameters
-    int maxT, V, L, NH, C;
-    model->config.max_seq_len = maxT = model_header[2];
-    model->config.vocab_size = V = model_header[3];
-    model->config.num_layers = L = model_header[4];
-    model->config.num_heads = NH = model_header[5];
-    model->config.channels = C = model_header[6];
-
-    // allocate space for all the parameters and read them in
+    // the sizes of all the parameters
     model->param_sizes[0] = V * C; // wte
     model->param_sizes[1] = maxT * C; // wpe
     model->param_sizes[2] = L * C; // ln1w
@@ -487,26 +1770,183 @@ void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path) {
         num_parameters += model->param_sizes[i];
     }
     model->num_parameters = num_parameters;
-
-    // read in all the parameters from file
-    model->params_memory = malloc_and_point_parameters(&model->params, model->param_sizes);
-    fread(model->params_memory, sizeof(float), num_parameters, model_file);
-    fclose(model_file);
+    model->params_memory = NULL;
+    model->params_mapping = NULL;
+    model->packed = (PackedTensors){NULL, NULL, NULL, NULL};
+    model->packed_memory = NULL;
+    model->packed_mapping = NULL;
 
     // other inits
     model->acts_memory = NULL;
+    model->acts_capacity = 0;
     model->grads_memory = NULL;
     model->m_memory = NULL;
     model->v_memory = NULL;
     model->grads_acts_memory = NULL;
     model->inputs = NULL;
+    model->inputs_capacity = 0;
     model->targets = NULL;
+    model->kv_cache = NULL;
+    model->kv_slots = 0;
+    model->infer_memory = NULL;
+    model->infer_capacity = 0;
     model->batch_size = 0;
     model->seq_len = 0;
     model->mean_loss = -1.0f; // -1.0f will designate no loss
 }
 
-void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
+#ifdef PACK_WEIGHTS
+#define PACKED_MAGIC 20240613
+#define PACKED_HEADER 16 // ints, so the weights after it stay cache line aligned
+
+// pack the matmul weights of every layer of an fp32 model for matmul_forward_packed.
+// if packed_path is given they are kept in that sidecar file, which later runs
+// map (or read) instead of packing again. the file is tagged with the size and
+// the modification time of the checkpoint, and is packed again when those change.
+// without a packed_path (or a checkpoint_path, for a synthetic model) they are
+// only packed in memory
+void gpt2_pack_weights(GPT2 *model, char* checkpoint_path, char* packed_path) {
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    if (model->qparams.wte.q != NULL || C % MATMUL_PANEL != 0) { return; }
+    float* weights[4] = {model->params.qkvw, model->params.attprojw, model->params.fcw, model->params.fcprojw};
+    int OCs[4] = {3*C, C, 4*C, C};
+    int Cs[4] = {C, C, C, 4*C};
+    size_t floats = 0;
+    for (int w = 0; w < 4; w++) { floats += (size_t)L * OCs[w] * Cs[w]; }
+    size_t bytes = floats * sizeof(float);
+
+    struct stat st = {0};
+    char* path = checkpoint_path != NULL ? packed_path : NULL;
+    if (path != NULL && stat(checkpoint_path, &st) != 0) { path = NULL; }
+    unsigned long long size = st.st_size, mtime = st.st_mtime;
+    int header[PACKED_HEADER] = {PACKED_MAGIC, L, C, (int)size, (int)(size >> 32), (int)mtime, (int)(mtime >> 32)};
+
+    float* packed = NULL;
+    FILE* file = path != NULL ? fopen(path, "rb") : NULL;
+    if (file != NULL) {
+        int file_header[PACKED_HEADER];
+        if (fread(file_header, sizeof(int), PACKED_HEADER, file) == PACKED_HEADER &&
+            memcmp(file_header, header, sizeof(header)) == 0) {
+#ifdef MMAP_CHECKPOINT
+            size_t mapping_size = sizeof(header) + bytes;
+            struct stat packed_st;
+            if (fstat(fileno(file), &packed_st) == 0 && (size_t)packed_st.st_size == mapping_size) {
+                void* base = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+                if (base != MAP_FAILED) {
+                    madvise(base, mapping_size, MADV_WILLNEED);
+                    model->packed_mapping = base;
+                    model->packed_mapping_size = mapping_size;
+                    packed = (float*)((char*)base + sizeof(header));
+                }
+            }
+#endif
+            if (packed == NULL) {
+                model->packed_memory = (float*)aligned_alloc(64, bytes);
+                if (fread(model->packed_memory, 1, bytes, file) == bytes) {
+                    packed = model->packed_memory;
+                } else {
+                    free(model->packed_memory);
+                    model->packed_memory = NULL;
+                }
+            }
+        }
+        fclose(file);
+    }
+
+    if (packed == NULL) {
+        packed = model->packed_memory = (float*)aligned_alloc(64, bytes);
+        float* p = packed;
+        for (int w = 0; w < 4; w++) {
+            for (int l = 0; l < L; l++) {
+                size_t n = (size_t)OCs[w] * Cs[w];
+                pack_weights(p, weights[w] + l * n, Cs[w], OCs[w]);
+                p += n;
+            }
+        }
+        // write the sidecar under a temporary name first, so a run that is
+        // interrupted halfway never leaves a broken one behind
+        if (path != NULL) {
+            size_t tmp_size = strlen(path) + 5;
+            char* tmp_path = (char*)malloc(tmp_size);
+            snprintf(tmp_path, tmp_size, "%s.tmp", path);
+            file = fopen(tmp_path, "wb");
+            if (file == NULL || fwrite(header, sizeof(header), 1, file) != 1 ||
+                fwrite(packed, 1, bytes, file) != bytes || fclose(file) != 0 || rename(tmp_path, path) != 0) {
+                fprintf(stderr, "Could not write %s, the weights will be packed again next time\n", path);
+                remove(tmp_path);
+            }
+            free(tmp_path);
+        }
+    }
+
+    size_t offset = 0;
+    float** ptrs[4] = {&model->packed.qkvw, &model->packed.attprojw, &model->packed.fcw, &model->packed.fcprojw};
+    for (int w = 0; w < 4; w++) {
+        *ptrs[w] = packed + offset;
+        offset += (size_t)L * OCs[w] * Cs[w];
+    }
+    numa_replicate(packed, bytes);
+}
+#endif
+
+// replicate on every NUMA node only what the matmuls read through numa_local: the
+// Q8_0 or fp32 weights, except the layer weights of a packed model, whose packed
+// copy gpt2_pack_weights replicates. the rest stays shared in the page cache
+void gpt2_replicate_weights(GPT2 *model, int version) {
+    float* weights[] = {model->params.wte, model->params.qkvw, model->params.attprojw, model->params.fcw, model->params.fcprojw};
+    Q8Tensor* qweights[] = {&model->qparams.wte, &model->qparams.qkvw, &model->qparams.attprojw, &model->qparams.fcw, &model->qparams.fcprojw};
+    int indices[] = {0, 4, 6, 10, 12}; // in param_sizes
+    for (int w = 0; w < 5; w++) {
+        size_t n = model->param_sizes[indices[w]];
+        if (version == 2) {
+            numa_replicate(qweights[w]->q, n + n / QK * sizeof(float));
+        } else if (w == 0 || model->packed.qkvw == NULL) {
+            numa_replicate(weights[w], n * sizeof(float));
+        }
+    }
+}
+
+// packed_path is where gpt2_pack_weights keeps the packed weights, NULL to
+// pack them in memory only
+void gpt2_build_from_checkpoint(GPT2 *model, char* checkpoint_path, char* packed_path) {
+
+    // read in model from a checkpoint file
+    FILE *model_file = fopen(checkpoint_path, "rb");
+    if (model_file == NULL) { printf("Error opening model file\n"); exit(1); }
+    int model_header[256];
+    fread(model_header, sizeof(int), 256, model_file);
+    if (model_header[0] != 20240326) { printf("Bad magic model file"); exit(1); }
+    if (model_header[1] != 1 && model_header[1] != 2) { printf("Bad version in model file"); exit(1); }
+    int version = model_header[1];
+    if (version == 2 && (model_header[7] != QK || model_header[6] % QK != 0)) { printf("Bad quantization in model file"); exit(1); }
+
+    // read in hyperparameters
+    GPT2Config config;
+    config.max_seq_len = model_header[2];
+    config.vocab_size = model_header[3];
+    config.num_layers = model_header[4];
+    config.num_heads = model_header[5];
+    config.channels = model_header[6];
+    gpt2_init(model, config);
+
+    // read in all the parameters from file
+#ifdef MMAP_CHECKPOINT
+    model->params_memory = mmap_and_point_parameters(&model->params, &model->qparams, model->param_sizes, version,
+                                                     model_file, &model->params_mapping, &model->params_mapping_size);
+#endif
+    if (model->params_memory == NULL) {
+        model->params_memory = malloc_and_point_parameters(&model->params, &model->qparams, model->param_sizes, version);
+        fread(model->params_memory, 1, parameters_bytes(model->param_sizes, version), model_file);
+    }
+    fclose(model_file);
+#ifdef PACK_WEIGHTS
+    gpt2_pack_weights(model, checkpoint_path, packed_path);
+#endif
+    gpt2_replicate_weights(model, version);
+}
+
+void gpt2_alloc_activations(GPT2 *model, int* inputs, int B, int T) {
     // convenience parameters
     int V = model->config.vocab_size;
     int L = model->config.num_layers;
@@ -540,32 +1980,100 @@ void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
     model->act_sizes[20] = B * T * V; // logits
     model->act_sizes[21] = B * T * V; // probs
     model->act_sizes[22] = B * T; // losses
+    model->act_sizes[23] = B * T * 2 * ((V + SOFTMAX_CHUNK - 1) / SOFTMAX_CHUNK); // softmax_scratch
     size_t num_activations = 0;
     for (size_t i = 0; i < NUM_ACTIVATION_TENSORS; i++) {
         num_activations += model->act_sizes[i];
     }
     model->num_activations = num_activations;
 
-    if (model->acts_memory) {
+    // the arena is reused across calls and only grows, geometrically, so decoding
+    // a sequence allocates O(log maxT) times in total instead of once per token.
+    // every call just re-points the tensors for the current B, T
+    if (num_activations > model->acts_capacity) {
+        size_t capacity = 2 * model->acts_capacity;
+        if (capacity < num_activations) { capacity = num_activations; }
         free(model->acts_memory);
-        model->acts_memory = NULL;
+        model->acts_memory = (float*)malloc(capacity * sizeof(float));
+        model->acts_capacity = capacity;
     }
-    model->acts_memory = malloc_and_point_activations(&model->acts, model->act_sizes);
+    point_activations(&model->acts, model->act_sizes, model->acts_memory);
 
-    // also create memory for caching inputs and targets
-    if (model->inputs) {
+    // also create memory for caching inputs and targets, the same way
+    if ((size_t)(B * T) > model->inputs_capacity) {
+        size_t capacity = 2 * model->inputs_capacity;
+        if (capacity < (size_t)(B * T)) { capacity = B * T; }
         free(model->inputs);
+        model->inputs = (int*)malloc(capacity * sizeof(int));
+        model->inputs_capacity = capacity;
     }
-    model->inputs = (int*)malloc(B * T * sizeof(int));
 
     // cache the inputs/targets
     memcpy(model->inputs, inputs, B * T * sizeof(int));
+}
+
+void gpt2_alloc_inference(GPT2 *model, int N, int num_outputs) {
+    // like gpt2_alloc_activations, but for the InferenceTensors of gpt2_decode_rows
+    // with N rows, num_outputs of which need logits. these are O(N*C) and do not
+    // depend on the number of layers
+    int V = model->config.vocab_size;
+    int C = model->config.channels;
+    size_t infer_sizes[NUM_INFERENCE_TENSORS] = {
+        N * C, // residual
+        N * C, // residual2
+        num_outputs * C, // lnf
+        N * 3*C, // qkv
+        N * C, // atty
+        N * 4*C, // fch
+        num_outputs * V, // logits
+        N * C, // ln
+        N * 4*C / QK, // iscale
+    };
+    size_t num_floats = 0;
+    for (size_t i = 0; i < NUM_INFERENCE_TENSORS; i++) {
+        num_floats += infer_sizes[i];
+    }
+    size_t qinp_floats = (size_t)N * 4*C / sizeof(float); // int8 qinp goes after the floats
+    num_floats += qinp_floats;
+    if (num_floats > model->infer_capacity) {
+        size_t capacity = 2 * model->infer_capacity;
+        if (capacity < num_floats) { capacity = num_floats; }
+        free(model->infer_memory);
+        model->infer_memory = (float*)malloc(capacity * sizeof(float));
+        model->infer_capacity = capacity;
+    }
+    InferenceTensors* infer = &model->infer;
+    float** ptrs[] = {
+        &infer->residual, &infer->residual2, &infer->lnf,
+        &infer->qkv, &infer->atty, &infer->fch, &infer->logits, &infer->ln, &infer->iscale
+    };
+    float* infer_memory_iterator = model->infer_memory;
+    for (size_t i = 0; i < NUM_INFERENCE_TENSORS; i++) {
+        *(ptrs[i]) = infer_memory_iterator;
+        infer_memory_iterator += infer_sizes[i];
+    }
+    infer->qinp = (int8_t*)infer_memory_iterator;
+}
+
+void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
+    // convenience parameters
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int NH = model->config.num_heads;
+    int C = model->config.channels;
+
+    // the full forward pass keeps the fp32 layout, quantized models only decode
+    assert(model->qparams.qkvw.q == NULL);
+
+    gpt2_alloc_activations(model, inputs, B, T);
 
     // forward pass
     ParameterTensors params = model->params; // for brevity
     ActivationTensors acts = model->acts;
     float* residual;
+    PROFILE_START();
     encoder_forward(acts.encoded, inputs, params.wte, params.wpe, B, T, C); // encoding goes into residual[0]
+    PROFILE_OP(-1, OP_ENCODER);
     for (int l = 0; l < L; l++) {
 
         residual = l == 0 ? acts.encoded : acts.residual3 + (l-1) * B * T * C;
@@ -604,20 +2112,171 @@ void gpt2_forward(GPT2 *model, int* inputs, int B, int T) {
 
         // now do the forward pass
         layernorm_forward(l_ln1, l_ln1_mean, l_ln1_rstd, residual, l_ln1w, l_ln1b, B, T, C);
+        PROFILE_OP(l, OP_LAYERNORM);
         matmul_forward(l_qkv, l_ln1, l_qkvw, l_qkvb, B, T, C, 3*C);
+        PROFILE_OP(l, OP_QKV);
         attention_forward(l_atty, l_preatt, l_att, l_qkv, B, T, C, NH);
+        PROFILE_OP(l, OP_ATTENTION);
         matmul_forward(l_attproj, l_atty, l_attprojw, l_attprojb, B, T, C, C);
+        PROFILE_OP(l, OP_ATTPROJ);
         residual_forward(l_residual2, residual, l_attproj, B*T*C);
+        PROFILE_OP(l, OP_RESIDUAL);
         layernorm_forward(l_ln2, l_ln2_mean, l_ln2_rstd, l_residual2, l_ln2w, l_ln2b, B, T, C);
+        PROFILE_OP(l, OP_LAYERNORM);
         matmul_forward(l_fch, l_ln2, l_fcw, l_fcb, B, T, C, 4*C);
+        PROFILE_OP(l, OP_FC);
         gelu_forward(l_fch_gelu, l_fch, B*T*4*C);
+        PROFILE_OP(l, OP_GELU);
         matmul_forward(l_fcproj, l_fch_gelu, l_fcprojw, l_fcprojb, B, T, 4*C, C);
+        PROFILE_OP(l, OP_FCPROJ);
         residual_forward(l_residual3, l_residual2, l_fcproj, B*T*C);
+        PROFILE_OP(l, OP_RESIDUAL);
     }
     residual = acts.residual3 + (L-1) * B * T * C; // last residual is in residual3
     layernorm_forward(acts.lnf, acts.lnf_mean, acts.lnf_rstd, residual, params.lnfw, params.lnfb, B, T, C);
+    PROFILE_OP(-1, OP_LNF);
     matmul_forward(acts.logits, acts.lnf, params.wte, NULL, B, T, C, V);
-    softmax_forward(acts.probs, acts.logits, B, T, V);
+    PROFILE_OP(-1, OP_LOGITS);
+    softmax_forward(acts.probs, acts.logits, acts.softmax_scratch, B, T, V);
+    PROFILE_OP(-1, OP_SOFTMAX);
+}
+
+// matmul_forward_fused against the (OC, C) slice at `offset` of a weight tensor,
+// in whichever format the model holds it: the Q8_0 qw if quantized, the packed
+// pw if packed, else w
+void matmul_forward_weight(float* out, float* inp, float* w, Q8Tensor qw, float* pw, size_t offset,
+                           float* bias, int B, int T, int C, int OC, MatmulFusion* fusion) {
+    if (qw.q != NULL) {
+        matmul_forward_q8(out, inp, qw.q + offset, qw.d + offset / QK, bias, B, T, C, OC, fusion);
+    } else if (pw != NULL) {
+        matmul_forward_packed(out, inp, pw + offset, bias, B, T, C, OC, fusion);
+    } else {
+        matmul_forward_fused(out, inp, w + offset, bias, B, T, C, OC, fusion);
+    }
+}
+
+void gpt2_alloc_kv_cache(GPT2 *model, int num_slots) {
+    // (re)allocate the cache for num_slots sequences of up to maxT tokens,
+    // this forgets every sequence that was being decoded
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    int maxT = model->config.max_seq_len;
+    free(model->kv_cache);
+    model->kv_cache = (float*)malloc((size_t)L * num_slots * maxT * 2*C * sizeof(float));
+    model->kv_slots = num_slots;
+}
+
+void gpt2_decode_rows(GPT2 *model, int* inputs, int* slots, int* pos, int N,
+                      int* outputs, int num_outputs) {
+    // like gpt2_forward, but only runs N new tokens through the model, which can
+    // belong to different sequences: row n is token inputs[n] at position pos[n]
+    // of the sequence held in kv cache slot slots[n]. the keys and values of the
+    // earlier positions are taken from the cache filled by the previous calls, so
+    // decoding one token at a time costs the same at every position instead of
+    // growing with the sequence, and a new sequence can be prefilled in the same
+    // call as other sequences are decoded. the rows of a sequence must be given
+    // in position order. the output is model->infer.logits, the (num_outputs, V)
+    // next token logits after each of the rows listed in outputs, which the
+    // sampler reads directly
+    int V = model->config.vocab_size;
+    int L = model->config.num_layers;
+    int NH = model->config.num_heads;
+    int C = model->config.channels;
+    int maxT = model->config.max_seq_len;
+    for (int n = 0; n < N; n++) {
+        assert(0 <= slots[n] && slots[n] < model->kv_slots);
+        assert(0 <= pos[n] && pos[n] < maxT);
+    }
+
+    gpt2_alloc_inference(model, N, num_outputs);
+
+    ParameterTensors params = model->params; // for brevity
+    QuantizedTensors qparams = model->qparams;
+    InferenceTensors infer = model->infer;
+    PROFILE_START();
+    // every row takes the positional embedding of its own position
+    for (int n = 0; n < N; n++) {
+        if (qparams.wte.q != NULL) {
+            encoder_forward_q8(infer.residual + n * C, inputs + n, qparams.wte.q, qparams.wte.d, params.wpe + pos[n] * C, 1, 1, C);
+        } else {
+            encoder_forward(infer.residual + n * C, inputs + n, params.wte, params.wpe + pos[n] * C, 1, 1, C);
+        }
+    }
+    PROFILE_OP(-1, OP_ENCODER);
+    for (int l = 0; l < L; l++) {
+
+        // get the pointers of the weights for this layer, the matmul weights
+        // are sliced by matmul_forward_weight as they may be quantized
+        float* l_ln1w = params.ln1w + l * C;
+        float* l_ln1b = params.ln1b + l * C;
+        float* l_qkvb = params.qkvb + l * 3*C;
+        float* l_attprojb = params.attprojb + l * C;
+        float* l_ln2w = params.ln2w + l * C;
+        float* l_ln2b = params.ln2b + l * C;
+        float* l_fcb = params.fcb + l * 4*C;
+        float* l_fcprojb = params.fcprojb + l * C;
+        float* l_kv = model->kv_cache + (size_t)l * model->kv_slots * maxT * 2*C;
+
+        // the fused work of each matmul in this layer, which all share the scratch in infer
+        MatmulFusion ln1 = {.ln_weight = l_ln1w, .ln_bias = l_ln1b, .ln_out = infer.ln, .qinp = infer.qinp, .iscale = infer.iscale};
+        MatmulFusion attproj_residual = {.residual = infer.residual, .qinp = infer.qinp, .iscale = infer.iscale};
+        MatmulFusion ln2_gelu = {.ln_weight = l_ln2w, .ln_bias = l_ln2b, .gelu = 1, .ln_out = infer.ln, .qinp = infer.qinp, .iscale = infer.iscale};
+        MatmulFusion fcproj_residual = {.residual = infer.residual2, .qinp = infer.qinp, .iscale = infer.iscale};
+
+        // now do the forward pass, the residual stream goes from residual to
+        // residual2 and back, so every layer starts and ends in residual.
+        // apart from attention every layer treats the rows independently
+        matmul_forward_weight(infer.qkv, infer.residual, params.qkvw, qparams.qkvw, model->packed.qkvw, (size_t)l * 3*C * C, l_qkvb, N, 1, C, 3*C, &ln1);
+        PROFILE_OP(l, OP_QKV);
+        attention_forward_kv(infer.atty, infer.qkv, l_kv, N, slots, pos, maxT, C, NH);
+        PROFILE_OP(l, OP_ATTENTION);
+        matmul_forward_weight(infer.residual2, infer.atty, params.attprojw, qparams.attprojw, model->packed.attprojw, (size_t)l * C * C, l_attprojb, N, 1, C, C, &attproj_residual);
+        PROFILE_OP(l, OP_ATTPROJ);
+        matmul_forward_weight(infer.fch, infer.residual2, params.fcw, qparams.fcw, model->packed.fcw, (size_t)l * 4*C * C, l_fcb, N, 1, C, 4*C, &ln2_gelu);
+        PROFILE_OP(l, OP_FC);
+        matmul_forward_weight(infer.residual, infer.fch, params.fcprojw, qparams.fcprojw, model->packed.fcprojw, (size_t)l * C * 4*C, l_fcprojb, N, 1, 4*C, C, &fcproj_residual);
+        PROFILE_OP(l, OP_FCPROJ);
+    }
+    // only the output rows are sampled from, so the final layernorm and
+    // the (C, V) classifier run on those alone
+    for (int i = 0; i < num_outputs; i++) {
+        float* row = infer.residual + (size_t)outputs[i] * C;
+        layernorm_forward(infer.lnf + i * C, NULL, NULL, row, params.lnfw, params.lnfb, 1, 1, C);
+    }
+    PROFILE_OP(-1, OP_LNF);
+    MatmulFusion logits_scratch = {.qinp = infer.qinp, .iscale = infer.iscale};
+    matmul_forward_weight(infer.logits, infer.lnf, params.wte, qparams.wte, NULL, 0, NULL, num_outputs, 1, C, V, &logits_scratch);
+    PROFILE_OP(-1, OP_LOGITS);
+}
+
+void gpt2_decode(GPT2 *model, int* inputs, int B, int T, int pos) {
+    // gpt2_decode_rows for B sequences in slots 0..B-1 that are all at the same
+    // position: runs the (B, T) new tokens at positions pos..pos+T-1, and gives
+    // the (B, V) next token logits after the last of them.
+    // call with pos = 0 to (re)start the sequences
+    int maxT = model->config.max_seq_len;
+    assert(0 <= pos && pos + T <= maxT);
+
+    // the cache holds every position of the batch, so it is sized once for maxT
+    if (model->kv_cache == NULL || model->kv_slots != B) {
+        assert(pos == 0);
+        gpt2_alloc_kv_cache(model, B);
+    }
+
+    int* row_slots = (int*)malloc(B * T * sizeof(int));
+    int* row_pos = (int*)malloc(B * T * sizeof(int));
+    int* outputs = (int*)malloc(B * sizeof(int));
+    for (int b = 0; b < B; b++) {
+        for (int t = 0; t < T; t++) {
+            row_slots[b * T + t] = b;
+            row_pos[b * T + t] = pos + t;
+        }
+        outputs[b] = b * T + T - 1;
+    }
+    gpt2_decode_rows(model, inputs, row_slots, row_pos, B * T, outputs, B);
+    free(row_slots);
+    free(row_pos);
+    free(outputs);
 }
 
 void gpt2_zero_grad(GPT2 *model) {
@@ -626,7 +2285,20 @@ void gpt2_zero_grad(GPT2 *model) {
 }
 
 void gpt2_free(GPT2 *model) {
-    free(model->params_memory);
+    numa_free();
+    if (model->packed_mapping != NULL) {
+#ifdef MMAP_CHECKPOINT
+        munmap(model->packed_mapping, model->packed_mapping_size);
+#endif
+    }
+    free(model->packed_memory);
+    if (model->params_mapping != NULL) {
+#ifdef MMAP_CHECKPOINT
+        munmap(model->params_mapping, model->params_mapping_size);
+#endif
+    } else {
+        free(model->params_memory);
+    }
     free(model->grads_memory);
     free(model->m_memory);
     free(model->v_memory);
@@ -634,86 +2306,877 @@ void gpt2_free(GPT2 *model) {
     free(model->grads_acts_memory);
     free(model->inputs);
     free(model->targets);
+    free(model->kv_cache);
+    free(model->infer_memory);
 }
 
-int sample_mult(float* probabilities, int n) {
-    // sample index from probabilities (they must sum to 1!)
-    // coin can be a random number in [0, 1), usually from random_f32()
-    float cdf = 0.0f, coin = 0.5f;
-    for (int i = 0; i < n; i++) {
-        cdf += probabilities[i];
+// ----------------------------------------------------------------------------
+// sampler: picks the next token straight from the logits. top-k keeps the k
+// largest logits with a min-heap, and only those k candidates are exponentiated,
+// sorted and cut down to top-p, so there is no softmax over the whole vocabulary
+
+unsigned int random_u32(unsigned long long *state) {
+    // xorshift rng: https://en.wikipedia.org/wiki/Xorshift#xorshift.2A
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+
+float random_f32(unsigned long long *state) { // random float32 in [0,1)
+    return (random_u32(state) >> 8) / 16777216.0f;
+}
+
+typedef struct {
+    float logit; // the logit, then its unnormalized probability
+    int index; // the token
+} Candidate;
+
+typedef struct {
+    float temperature; // 0 picks the most likely token
+    int top_k; // sample from the k most likely tokens, 0 for all of them
+    float top_p; // then from the fewest whose probability adds up to top_p
+    unsigned long long rng_state;
+    Candidate* candidates; // (V) scratch
+} Sampler;
+
+void sampler_init(Sampler* sampler, int V, float temperature, int top_k, float top_p, unsigned long long seed) {
+    sampler->temperature = temperature;
+    sampler->top_k = top_k > 0 && top_k < V ? top_k : V;
+    sampler->top_p = top_p;
+    sampler->rng_state = seed != 0 ? seed : 1; // xorshift gets stuck at 0
+    sampler->candidates = (Candidate*)malloc(V * sizeof(Candidate));
+}
+
+void sampler_free(Sampler* sampler) {
+    free(sampler->candidates);
+}
+
+static void heap_sift_down(Candidate* heap, int k, int i) {
+    // restore the min-heap (by logit) of k candidates below i
+    for (;;) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < k && heap[l].logit < heap[min].logit) { min = l; }
+        if (r < k && heap[r].logit < heap[min].logit) { min = r; }
+        if (min == i) { return; }
+        Candidate tmp = heap[i]; heap[i] = heap[min]; heap[min] = tmp;
+        i = min;
+    }
+}
+
+static int compare_candidates(const void* a, const void* b) {
+    float la = ((Candidate*)a)->logit, lb = ((Candidate*)b)->logit;
+    return (la < lb) - (la > lb); // descending
+}
+
+int sampler_sample(Sampler* sampler, float* logits, int V) {
+    if (sampler->temperature == 0.0f) {
+        int best = 0;
+        for (int i = 1; i < V; i++) {
+            if (logits[i] > logits[best]) { best = i; }
+        }
+        return best;
+    }
+
+    // the k largest logits, in a min-heap so that a logit only has to beat the root
+    Candidate* c = sampler->candidates;
+    int k = sampler->top_k;
+    for (int i = 0; i < k; i++) {
+        c[i].logit = logits[i];
+        c[i].index = i;
+    }
+    for (int i = k / 2 - 1; i >= 0; i--) {
+        heap_sift_down(c, k, i);
+    }
+    for (int i = k; i < V; i++) {
+        if (logits[i] > c[0].logit) {
+            c[0].logit = logits[i];
+            c[0].index = i;
+            heap_sift_down(c, k, 0);
+        }
+    }
+
+    // exponentiate the candidates, relative to the largest for numerical stability
+    float maxval = -INFINITY;
+    for (int i = 0; i < k; i++) {
+        maxval = fmaxf(maxval, c[i].logit);
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < k; i++) {
+        c[i].logit = expf((c[i].logit - maxval) / sampler->temperature);
+        sum += c[i].logit;
+    }
+
+    // keep the most likely candidates that make up top_p of the probability
+    if (sampler->top_p < 1.0f) {
+        // a candidate below (1 - top_p) / (k - 1) of the sum can never be needed to
+        // reach top_p, so only the few above it are sorted (even when top_k is off).
+        // the largest candidate, whose weight is exactly 1, is always kept
+        if (k > 1) {
+            float threshold = fminf((1.0f - sampler->top_p) / (k - 1) * sum, 1.0f);
+            int n = 0;
+            for (int i = 0; i < k; i++) {
+                if (c[i].logit >= threshold) { c[n++] = c[i]; }
+            }
+            k = n;
+        }
+        qsort(c, k, sizeof(Candidate), compare_candidates);
+        float cutoff = sampler->top_p * sum, cdf = 0.0f;
+        int n = 0;
+        while (n < k - 1 && cdf + c[n].logit < cutoff) {
+            cdf += c[n++].logit;
+        }
+        k = n + 1;
+        sum = cdf + c[n].logit;
+    }
+
+    float coin = random_f32(&sampler->rng_state) * sum, cdf = 0.0f;
+    for (int i = 0; i < k; i++) {
+        cdf += c[i].logit;
         if (coin < cdf) {
-            return i;
+            return c[i].index;
         }
     }
-    return n - 1; // in case of rounding errors
+    return c[k - 1].index; // in case of rounding errors
 }
 
 // the GPT-2 end-of-text token id
 #define GPT2_EOT 50256
 
-Task dequeue_task()
-{
-    mutex_lock(&task_queue.mutex);
-    while (task_queue.count == 0)
-    {
-        cond_wait(&task_queue.consumer, &task_queue.mutex);
+// ----------------------------------------------------------------------------
+// prefix cache: the keys and values of the prompts that were already run. the
+// keys and values of a position only depend on the tokens up to it, so a new
+// prompt can take those of the longest prefix it shares with any cached prompt,
+// and only run the rest of its tokens. the prompts are bucketed by a hash of
+// their first PREFIX_BLOCK tokens, so a lookup only compares against those
+// that start the same way, and shared prefixes shorter than that are not worth
+// caching. the cache keeps the most recently used prompts that fit in its
+// budget, and can be saved to a file for later runs
+
+#ifndef PREFIX_CACHE_BYTES
+#define PREFIX_CACHE_BYTES (256ul << 20) // 0 turns the cache off
+#endif
+#define PREFIX_CACHE_MAGIC 20240611
+#define PREFIX_BLOCK 4 // tokens, a prompt has fewer than 10
+
+typedef struct {
+    int len;
+    int* tokens; // (len)
+    float* kv; // (L, len, 2*C) the keys and values of the tokens in every layer
+    size_t bytes; // the size of kv
+    unsigned long long last_used;
+    unsigned long long key; // hash of the first PREFIX_BLOCK tokens
+    int next; // the next entry in the same bucket, -1 at the end
+} PrefixEntry;
+
+typedef struct {
+    PrefixEntry* entries;
+    int num_entries;
+    int capacity; // a power of 2, also the number of buckets
+    int* buckets; // (capacity) the first entry of each bucket, -1 if it is empty
+    size_t bytes; // the size of the keys and values of all entries
+    size_t budget;
+    unsigned long long clock; // counts the uses, for the LRU order
+    unsigned long long fingerprint; // of the model, the keys and values only hold for it
+} PrefixCache;
+
+static unsigned long long fnv1a(unsigned long long h, const void* data, size_t size) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
     }
-    assert(task_queue.count > 0);
-    task_queue.count--;
-    Task task = task_queue.tasks[task_queue.front];
-    task_queue.tasks[task_queue.front] = (Task){NULL, NULL};
-    task_queue.front = (task_queue.front + 1) % BUFFER_SIZE;
-    cond_signal(&task_queue.producer);
-    mutex_unlock(&task_queue.mutex);
-    return task;
+    return h;
 }
 
-void enqueue_task(Task task)
-{
-    mutex_lock(&task_queue.mutex);
-    while (task_queue.count == BUFFER_SIZE)
-    {
-        cond_wait(&task_queue.producer, &task_queue.mutex);
+void prefix_cache_init(PrefixCache* cache, GPT2* model, size_t budget) {
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    cache->num_entries = cache->capacity = 0;
+    cache->bytes = 0;
+    cache->budget = budget;
+    cache->clock = 0;
+    cache->fingerprint = 0; // set by prefix_cache_fingerprint, only a cache file needs it
+}
+
+void prefix_cache_fingerprint(PrefixCache* cache, GPT2* model, const char* checkpoint_path) {
+    // the config, the checkpoint size and 64 bytes at 16 fixed offsets of the
+    // weights, enough to tell two checkpoints apart. this only touches 16 pages
+    // of a mmapped checkpoint, the rest stays on disk until it is used
+    unsigned long long h = fnv1a(0xcbf29ce484222325ull, &model->config, sizeof(GPT2Config));
+    struct stat st;
+    long long file_size = stat(checkpoint_path, &st) == 0 ? (long long)st.st_size : -1;
+    h = fnv1a(h, &file_size, sizeof(file_size));
+    int version = model->qparams.wte.q != NULL ? 2 : 1;
+    size_t size = parameters_bytes(model->param_sizes, version);
+    for (int i = 0; i < 16 && size >= 64; i++) {
+        h = fnv1a(h, (char*)model->params_memory + (size - 64) / 15 * i, 64);
+    }
+    cache->fingerprint = h;
+}
+
+static unsigned long long prefix_key(int* tokens) {
+    return fnv1a(0xcbf29ce484222325ull, tokens, PREFIX_BLOCK * sizeof(int));
+}
+
+static int* prefix_bucket(PrefixCache* cache, unsigned long long key) {
+    return &cache->buckets[key & (cache->capacity - 1)];
+}
+
+static void prefix_cache_link(PrefixCache* cache, int i) {
+    int* bucket = prefix_bucket(cache, cache->entries[i].key);
+    cache->entries[i].next = *bucket;
+    *bucket = i;
+}
+
+static void prefix_cache_unlink(PrefixCache* cache, int i) {
+    int* link = prefix_bucket(cache, cache->entries[i].key);
+    while (*link != i) { link = &cache->entries[*link].next; }
+    *link = cache->entries[i].next;
+}
+
+static void prefix_cache_rehash(PrefixCache* cache) {
+    // rebuild the buckets, after the capacity or the order of the entries changed
+    cache->buckets = (int*)realloc(cache->buckets, cache->capacity * sizeof(int));
+    for (int b = 0; b < cache->capacity; b++) { cache->buckets[b] = -1; }
+    for (int i = 0; i < cache->num_entries; i++) { prefix_cache_link(cache, i); }
+}
+
+static void prefix_cache_remove(PrefixCache* cache, int i) {
+    cache->bytes -= cache->entries[i].bytes;
+    free(cache->entries[i].tokens);
+    free(cache->entries[i].kv);
+    prefix_cache_unlink(cache, i);
+    int last = --cache->num_entries;
+    if (i != last) {
+        // the last entry moves to i
+        prefix_cache_unlink(cache, last);
+        cache->entries[i] = cache->entries[last];
+        prefix_cache_link(cache, i);
+    }
+}
+
+static void prefix_cache_add(PrefixCache* cache, int* tokens, int len, float* kv, size_t bytes) {
+    // add the prompt tokens with its keys and values kv, both malloc'ed, which the
+    // cache takes over. a prompt that is a prefix of a cached one is not needed
+    // and a cached prompt that is a prefix of this one is not needed anymore,
+    // both are in the bucket of this prompt
+    unsigned long long key = len >= PREFIX_BLOCK ? prefix_key(tokens) : 0;
+    int i = cache->num_entries > 0 && len >= PREFIX_BLOCK ? *prefix_bucket(cache, key) : -1;
+    while (i >= 0) {
+        PrefixEntry* e = &cache->entries[i];
+        int next = e->next;
+        int n = e->len < len ? e->len : len;
+        if (e->key == key && memcmp(e->tokens, tokens, n * sizeof(int)) == 0) {
+            if (e->len >= len) {
+                e->last_used = ++cache->clock;
+                free(tokens);
+                free(kv);
+                return;
+            }
+            prefix_cache_remove(cache, i);
+            next = *prefix_bucket(cache, key); // the removal moved an entry, walk the bucket again
+        }
+        i = next;
+    }
+    if (len < PREFIX_BLOCK || bytes > cache->budget) {
+        free(tokens);
+        free(kv);
+        return;
+    }
+    // make room by dropping the least recently used prompts
+    while (cache->bytes + bytes > cache->budget) {
+        int lru = 0;
+        for (int i = 1; i < cache->num_entries; i++) {
+            if (cache->entries[i].last_used < cache->entries[lru].last_used) { lru = i; }
+        }
+        prefix_cache_remove(cache, lru);
+    }
+    if (cache->num_entries == cache->capacity) {
+        cache->capacity = cache->capacity ? 2 * cache->capacity : 16;
+        cache->entries = (PrefixEntry*)realloc(cache->entries, cache->capacity * sizeof(PrefixEntry));
+        prefix_cache_rehash(cache);
+    }
+    PrefixEntry* e = &cache->entries[cache->num_entries];
+    e->len = len;
+    e->tokens = tokens;
+    e->kv = kv;
+    e->bytes = bytes;
+    e->last_used = ++cache->clock;
+    e->key = key;
+    prefix_cache_link(cache, cache->num_entries++);
+    cache->bytes += bytes;
+}
+
+void prefix_cache_insert(PrefixCache* cache, GPT2* model, int* tokens, int len, int slot) {
+    // cache the prompt tokens, whose keys and values are in kv cache slot
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    int maxT = model->config.max_seq_len;
+    size_t bytes = (size_t)L * len * 2*C * sizeof(float);
+    if (len < PREFIX_BLOCK || bytes > cache->budget) { return; }
+    int* entry_tokens = (int*)malloc(len * sizeof(int));
+    float* kv = (float*)malloc(bytes);
+    memcpy(entry_tokens, tokens, len * sizeof(int));
+    for (int l = 0; l < L; l++) {
+        float* src = model->kv_cache + ((size_t)l * model->kv_slots + slot) * maxT * 2*C;
+        memcpy(kv + (size_t)l * len * 2*C, src, (size_t)len * 2*C * sizeof(float));
+    }
+    prefix_cache_add(cache, entry_tokens, len, kv, bytes);
+}
+
+int prefix_cache_lookup(PrefixCache* cache, GPT2* model, int* tokens, int len, int slot) {
+    // fill kv cache slot with the keys and values of the longest cached prefix of
+    // the prompt tokens, and return its length. at most len-1 tokens come from the
+    // cache, the last one has to run anyway for the logits that follow the prompt
+    if (len - 1 < PREFIX_BLOCK || cache->num_entries == 0) { return 0; }
+    unsigned long long key = prefix_key(tokens);
+    int best = -1, best_len = 0;
+    for (int i = *prefix_bucket(cache, key); i >= 0; i = cache->entries[i].next) {
+        PrefixEntry* e = &cache->entries[i];
+        if (e->key != key) { continue; }
+        int n = e->len < len - 1 ? e->len : len - 1;
+        int common = 0;
+        while (common < n && e->tokens[common] == tokens[common]) { common++; }
+        if (common > best_len) {
+            best = i;
+            best_len = common;
+        }
+    }
+    if (best < 0) { return 0; }
+
+    PrefixEntry* e = &cache->entries[best];
+    e->last_used = ++cache->clock;
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    int maxT = model->config.max_seq_len;
+    for (int l = 0; l < L; l++) {
+        float* dst = model->kv_cache + ((size_t)l * model->kv_slots + slot) * maxT * 2*C;
+        memcpy(dst, e->kv + (size_t)l * e->len * 2*C, (size_t)best_len * 2*C * sizeof(float));
+    }
+    return best_len;
+}
+
+static int compare_last_used(const void* a, const void* b) {
+    unsigned long long x = ((const PrefixEntry*)a)->last_used, y = ((const PrefixEntry*)b)->last_used;
+    return (x > y) - (x < y);
+}
+
+void prefix_cache_save(PrefixCache* cache, const char* path) {
+    // the file starts with 4 ints: magic, the model fingerprint (2 ints) and the
+    // number of prompts. then come the prompts from the least to the most recently
+    // used, each as its length, its tokens and its (L, len, 2*C) keys and values
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the prefix cache %s\n", path);
+        return;
+    }
+    qsort(cache->entries, cache->num_entries, sizeof(PrefixEntry), compare_last_used);
+    prefix_cache_rehash(cache);
+    int header[4] = {PREFIX_CACHE_MAGIC, (int)cache->fingerprint, (int)(cache->fingerprint >> 32), cache->num_entries};
+    fwrite(header, sizeof(int), 4, file);
+    for (int i = 0; i < cache->num_entries; i++) {
+        PrefixEntry* e = &cache->entries[i];
+        fwrite(&e->len, sizeof(int), 1, file);
+        fwrite(e->tokens, sizeof(int), e->len, file);
+        fwrite(e->kv, 1, e->bytes, file);
+    }
+    fclose(file);
+}
+
+void prefix_cache_load(PrefixCache* cache, GPT2* model, const char* path) {
+    // add the prompts saved by prefix_cache_save, if the file is there and was
+    // saved with the same model
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) { return; }
+    int header[4];
+    if (fread(header, sizeof(int), 4, file) != 4 || header[0] != PREFIX_CACHE_MAGIC ||
+        (unsigned)header[1] != (unsigned)cache->fingerprint || (unsigned)header[2] != (unsigned)(cache->fingerprint >> 32)) {
+        fprintf(stderr, "Ignoring the prefix cache %s, it is not for this model\n", path);
+        fclose(file);
+        return;
+    }
+    int L = model->config.num_layers;
+    int C = model->config.channels;
+    int maxT = model->config.max_seq_len;
+    for (int i = 0; i < header[3]; i++) {
+        int len;
+        if (fread(&len, sizeof(int), 1, file) != 1 || len <= 0 || len > maxT) { break; }
+        size_t bytes = (size_t)L * len * 2*C * sizeof(float);
+        int* tokens = (int*)malloc(len * sizeof(int));
+        float* kv = (float*)malloc(bytes);
+        if (fread(tokens, sizeof(int), len, file) != (size_t)len || fread(kv, 1, bytes, file) != bytes) {
+            free(tokens);
+            free(kv);
+            break;
+        }
+        prefix_cache_add(cache, tokens, len, kv, bytes);
+    }
+    fclose(file);
+}
+
+void prefix_cache_free(PrefixCache* cache) {
+    for (int i = 0; i < cache->num_entries; i++) {
+        free(cache->entries[i].tokens);
+        free(cache->entries[i].kv);
+    }
+    free(cache->entries);
+    free(cache->buckets);
+}
+
+// ----------------------------------------------------------------------------
+// serving: generate for many prompts at once with continuous batching. every
+// step decodes the newest token of each running sequence, together with the
+// whole prompt of any sequence that just started, in a single gpt2_decode_rows
+// call, so the weights are streamed from memory once per step for all of them.
+// a finished sequence frees its kv cache slot for the next prompt right away,
+// and a new one starts from the longest prefix of its prompt in the prefix cache
+
+typedef struct {
+    int id; // index of the request, in the order they were read
+    int prompt_len; // number of tokens given in the request
+    int len; // number of tokens so far, or 0 when the slot is free
+    int decoded; // number of tokens whose keys and values are in the cache
+    int* tokens; // (n)
+} Sequence;
+
+static int read_request(Sequence* seq, int n, int V, int* next_id) {
+    // read the next prompt, a line of token ids, into seq. returns 0 at the end of
+    // the input. prompts that cannot be served are answered right away and skipped
+    static char* line = NULL;
+    static size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, stdin) != -1) {
+        int len = 0, bad = 0;
+        char* p = line;
+        for (;;) {
+            char* end;
+            long token = strtol(p, &end, 10);
+            if (end == p) { break; }
+            if (token < 0 || token >= V) { bad = 1; }
+            if (len < n) { seq->tokens[len] = token; }
+            len++;
+            p = end;
+        }
+        if (len == 0) { continue; } // blank line
+        int id = (*next_id)++;
+        if (bad || len >= n) {
+            printf("%d: %s\n", id, bad ? "Bad token." : "Tow many tokens.");
+            fflush(stdout);
+            continue;
+        }
+        seq->id = id;
+        seq->prompt_len = seq->len = len;
+        seq->decoded = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void serve(GPT2* model, Sampler* sampler, PrefixCache* cache, int num_slots, int n) {
+    // reads one prompt per line from stdin, and prints "id: tokens..." with the
+    // generated tokens of each one as soon as it has n tokens
+    int V = model->config.vocab_size;
+    gpt2_alloc_kv_cache(model, num_slots);
+
+    Sequence* seqs = (Sequence*)calloc(num_slots, sizeof(Sequence));
+    for (int s = 0; s < num_slots; s++) {
+        seqs[s].tokens = (int*)malloc(n * sizeof(int));
+    }
+    // a step has at most one row per token of each slot's sequence
+    int* inputs = (int*)malloc(num_slots * n * sizeof(int));
+    int* slots = (int*)malloc(num_slots * n * sizeof(int));
+    int* pos = (int*)malloc(num_slots * n * sizeof(int));
+    int* outputs = (int*)malloc(num_slots * sizeof(int));
+    int* output_slots = (int*)malloc(num_slots * sizeof(int));
+
+    int next_id = 0, more = 1;
+    for (;;) {
+        // start new sequences in the free slots
+        for (int s = 0; s < num_slots && more; s++) {
+            if (seqs[s].len == 0) {
+                more = read_request(&seqs[s], n, V, &next_id);
+                if (more) {
+                    seqs[s].decoded = prefix_cache_lookup(cache, model, seqs[s].tokens, seqs[s].len, s);
+                }
+            }
+        }
+
+        // pack the tokens not yet in the cache of every running sequence
+        int N = 0, num_outputs = 0;
+        for (int s = 0; s < num_slots; s++) {
+            Sequence* seq = &seqs[s];
+            if (seq->len == 0) { continue; }
+            for (int t = seq->decoded; t < seq->len; t++) {
+                inputs[N] = seq->tokens[t];
+                slots[N] = s;
+                pos[N] = t;
+                N++;
+            }
+            seq->decoded = seq->len;
+            outputs[num_outputs] = N - 1;
+            output_slots[num_outputs] = s;
+            num_outputs++;
+        }
+        if (N == 0) { break; }
+
+        gpt2_decode_rows(model, inputs, slots, pos, N, outputs, num_outputs);
+
+        for (int i = 0; i < num_outputs; i++) {
+            Sequence* seq = &seqs[output_slots[i]];
+            if (seq->len == seq->prompt_len) {
+                // the prompt was just run, its keys and values are in the slot
+                prefix_cache_insert(cache, model, seq->tokens, seq->prompt_len, output_slots[i]);
+            }
+            seq->tokens[seq->len++] = sampler_sample(sampler, model->infer.logits + (size_t)i * V, V);
+            if (seq->len == n) {
+                printf("%d:", seq->id);
+                for (int t = seq->prompt_len; t < n; t++) {
+                    printf(" %d", seq->tokens[t]);
+                }
+                printf("\n");
+                fflush(stdout);
+                seq->len = 0;
+            }
+        }
+    }
+
+    for (int s = 0; s < num_slots; s++) {
+        free(seqs[s].tokens);
+    }
+    free(seqs);
+    free(inputs);
+    free(slots);
+    free(pos);
+    free(outputs);
+    free(output_slots);
+}
+
+#ifdef BENCH
+// ----------------------------------------------------------------------------
+// benchmark, built with -DBENCH (make gpt-bench): decodes with a randomly
+// initialized model of any shape, so no checkpoint is needed
+
+void gpt2_build_synthetic(GPT2 *model, GPT2Config config, unsigned long long seed) {
+    gpt2_init(model, config);
+    model->params_memory = malloc_and_point_parameters(&model->params, &model->qparams, model->param_sizes, 1);
+    // weights uniform with the 0.02 standard deviation GPT-2 is initialized with,
+    // layernorms are the identity
+    float* p = (float*)model->params_memory;
+    float a = 0.02f * sqrtf(3.0f);
+    for (size_t i = 0; i < (size_t)model->num_parameters; i++) {
+        p[i] = (2.0f * random_f32(&seed) - 1.0f) * a;
+    }
+    float* ones[] = {model->params.ln1w, model->params.ln2w, model->params.lnfw};
+    size_t sizes[] = {model->param_sizes[2], model->param_sizes[8], model->param_sizes[14]};
+    for (int t = 0; t < 3; t++) {
+        for (size_t i = 0; i < sizes[t]; i++) { ones[t][i] = 1.0f; }
+    }
+#ifdef PACK_WEIGHTS
+    gpt2_pack_weights(model, NULL, NULL); // like a checkpoint, so the benchmark runs the same kernels
+#endif
+    gpt2_replicate_weights(model, 1);
+}
+
+static double seconds_since(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int bench(int argc, char** argv) {
+    // -L layers, -C channels, -H heads, -V vocab size, -B sequences decoded at once,
+    // -T prompt length, -n tokens generated after the prompt; the default is GPT-2 124M
+    GPT2Config config = {.num_layers = 12, .channels = 768, .num_heads = 12, .vocab_size = 50257};
+    int B = 1, T = 64, steps = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "L:C:H:V:B:T:n:")) != -1) {
+        switch (opt) {
+            case 'L': config.num_layers = atoi(optarg); break;
+            case 'C': config.channels = atoi(optarg); break;
+            case 'H': config.num_heads = atoi(optarg); break;
+            case 'V': config.vocab_size = atoi(optarg); break;
+            case 'B': B = atoi(optarg); break;
+            case 'T': T = atoi(optarg); break;
+            case 'n': steps = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-L layers] [-C channels] [-H heads] [-V vocab] [-B batch] [-T prompt] [-n steps]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (config.num_heads <= 0 || config.channels % config.num_heads != 0 || T < 1 || steps < 0 || B < 1) {
+        printf("Bad benchmark shape\n");
+        exit(1);
+    }
+    config.max_seq_len = T + steps;
+
+    GPT2 model;
+    gpt2_build_synthetic(&model, config, 1337);
+    int V = config.vocab_size;
+    printf("L=%d C=%d NH=%d V=%d, %d parameters, B=%d T=%d steps=%d\n", config.num_layers, config.channels,
+           config.num_heads, V, model.num_parameters, B, T, steps);
+
+    int* tokens = (int*)malloc(B * T * sizeof(int));
+    unsigned long long rng = 42;
+    for (int i = 0; i < B * T; i++) {
+        tokens[i] = random_u32(&rng) % V;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    gpt2_decode(&model, tokens, B, T, 0);
+    double prefill = seconds_since(&start);
+    printf("prefill: %.1f ms, %.1f tokens/s\n", prefill * 1e3, B * T / prefill);
+
+    // greedy decoding, one token per sequence and step
+    int* next = (int*)malloc(B * sizeof(int));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < steps; t++) {
+        for (int b = 0; b < B; b++) {
+            float* logits = model.infer.logits + (size_t)b * V;
+            next[b] = 0;
+            for (int i = 1; i < V; i++) {
+                if (logits[i] > logits[next[b]]) { next[b] = i; }
+            }
+        }
+        gpt2_decode(&model, next, B, 1, T + t);
+    }
+    double decode = seconds_since(&start);
+    if (steps > 0) {
+        printf("decode: %.2f ms/step, %.1f tokens/s\n", decode * 1e3 / steps, B * steps / decode);
+    }
+    fflush(stdout); // before the profile report on stderr
+
+    free(tokens);
+    free(next);
+    gpt2_free(&model);
+    return 0;
+}
+#endif
+
+// ----------------------------------------------------------------------------
+// work-stealing thread pool
+
+void deque_push(Deque* q, int begin, int end) {
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    assert(b - t < DEQUE_SIZE);
+    Range* r = &q->ranges[b & (DEQUE_SIZE - 1)];
+    atomic_store_explicit(&r->begin, begin, memory_order_relaxed);
+    atomic_store_explicit(&r->end, end, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+int deque_take(Deque* q, int* begin, int* end) {
+    long b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    if (t > b) {
+        // empty
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        return 0;
+    }
+    Range* r = &q->ranges[b & (DEQUE_SIZE - 1)];
+    *begin = atomic_load_explicit(&r->begin, memory_order_relaxed);
+    *end = atomic_load_explicit(&r->end, memory_order_relaxed);
+    if (t == b) {
+        // last range, race against the thieves for it
+        int won = atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                      memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+int deque_steal(Deque* q, int* begin, int* end) {
+    long t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    if (t >= b) {
+        return 0;
+    }
+    Range* r = &q->ranges[t & (DEQUE_SIZE - 1)];
+    *begin = atomic_load_explicit(&r->begin, memory_order_relaxed);
+    *end = atomic_load_explicit(&r->end, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+               memory_order_seq_cst, memory_order_relaxed);
+}
+
+// run [begin, end) on thread id, splitting off the upper halves onto its own
+// deque first so that idle threads can steal them
+void pool_run(int id, int begin, int end) {
+    Job* job = &pool.job;
+    while (end - begin > job->grain) {
+        int mid = begin + (end - begin) / 2;
+        deque_push(&pool.deques[id], mid, end);
+        end = mid;
+    }
+#ifdef PROFILE
+    long t0 = profile_now();
+    job->function(job->arg, begin, end);
+    profile.workers[id].busy_ns += profile_now() - t0;
+    profile.workers[id].tasks++;
+#else
+    job->function(job->arg, begin, end);
+#endif
+    atomic_fetch_sub(&job->remaining, end - begin);
+}
+
+// help with the current job until all of its iterations are finished
+void pool_help(int id) {
+    int begin, end;
+    while (atomic_load(&pool.job.remaining) > 0) {
+        if (deque_take(&pool.deques[id], &begin, &end)) {
+            pool_run(id, begin, end);
+            continue;
+        }
+        int stolen = 0;
+        for (int k = 1; k <= pool.num_workers && !stolen; k++) {
+            int victim = (id + k) % (pool.num_workers + 1);
+            stolen = deque_steal(&pool.deques[victim], &begin, &end);
+        }
+        if (stolen) {
+#ifdef PROFILE
+            profile.workers[id].steals++;
+#endif
+            pool_run(id, begin, end);
+        } else {
+#ifdef PROFILE
+            profile.workers[id].misses++;
+#endif
+            sched_yield();
+        }
+    }
+}
+
+void parallel_for(void (*function)(void* arg, int begin, int end), void* arg, int n, int grain) {
+    // run function(arg, begin, end) over [0, n) on the main thread and the workers.
+    // only the main thread may call this; it returns once every iteration is done
+    if (grain < 1) { grain = 1; }
+    if (n <= grain) {
+#ifdef PROFILE
+        long t0 = profile_now();
+        function(arg, 0, n);
+        profile.workers[0].busy_ns += profile_now() - t0;
+        profile.workers[0].tasks++;
+#else
+        function(arg, 0, n);
+#endif
+        return;
     }
-    assert(task_queue.count < BUFFER_SIZE);
-    task_queue.count++;
-    task_queue.tasks[task_queue.rear] = task;
-    task_queue.rear = (task_queue.rear + 1) % BUFFER_SIZE;
-    cond_signal(&task_queue.consumer);
-    mutex_unlock(&task_queue.mutex);
+    Job* job = &pool.job;
+    job->function = function;
+    job->arg = arg;
+    job->grain = grain;
+    atomic_store(&job->remaining, n);
+    deque_push(&pool.deques[0], 0, n);
+
+    mutex_lock(&pool.mutex);
+    atomic_fetch_add(&pool.epoch, 1);
+    cond_broadcast(&pool.wakeup);
+    mutex_unlock(&pool.mutex);
+
+    pool_help(0);
 }
 
 void thread_function(int tid)
 {
+    pin_to_cpu(pool.cpus[tid]);
+    pool_node = pool.nodes[tid];
+    int seen = 0;
     while (1)
     {
-        Task task = dequeue_task();
-        task.function(task.arg);
-        free(task.arg);
+        // jobs come in bursts, so spin for a short while before going to sleep
+        for (int i = 0; i < POOL_SPIN && atomic_load(&pool.epoch) == seen; i++) {
+            sched_yield();
+        }
+        mutex_lock(&pool.mutex);
+        while (atomic_load(&pool.epoch) == seen)
+        {
+            cond_wait(&pool.wakeup, &pool.mutex);
+        }
+        seen = atomic_load(&pool.epoch);
+        mutex_unlock(&pool.mutex);
 
-        mutex_lock(&task_queue.finished_mutex);
-        task_queue.finished++;
-        cond_signal(&task_queue.task_finish);
-        mutex_unlock(&task_queue.finished_mutex);
+        pool_help(tid);
     }
 }
 
 int main(int argc, char** argv) {
-    for (int i = 0; i < THREAD_NUM; i++)
+#ifdef PROFILE
+    profile.start_ns = profile_now();
+    atexit(profile_report);
+#endif
+    pool_init_topology();
+    for (int i = 0; i < pool.num_workers; i++)
     {
         create(thread_function);
     }
+#ifdef BENCH
+    return bench(argc, argv);
+#endif
+
+    // -m picks the checkpoint, e.g. one written by quantize.py
+    // -s serves the prompts on stdin, decoding up to the given number at once
+    // -t, -k, -p set the sampler's temperature, top-k and top-p. the default
+    // temperature 0 is greedy, so the output is the same on every run unless -t
+    // asks for sampling, which -r seeds, by default with the time
+    // -c keeps the prefix cache in the given file across runs
+    // -w keeps the packed weights in the given file across runs, e.g. gpt2_124M.bin.packed
+    char* checkpoint_path = "gpt2_124M.bin";
+    char* cache_path = NULL;
+    char* packed_path = NULL;
+    int num_slots = 0;
+    float temperature = 0.0f, top_p = 0.95f;
+    int top_k = 40;
+    unsigned long long seed = time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:t:k:p:r:c:w:")) != -1) {
+        switch (opt) {
+            case 'm': checkpoint_path = optarg; break;
+            case 's': num_slots = atoi(optarg); break;
+            case 't': temperature = atof(optarg); break;
+            case 'k': top_k = atoi(optarg); break;
+            case 'p': top_p = atof(optarg); break;
+            case 'r': seed = strtoull(optarg, NULL, 10); break;
+            case 'c': cache_path = optarg; break;
+            case 'w': packed_path = optarg; break;
+            default:
+                printf("Usage: %s [-m checkpoint] [-s batch] [-t temperature] [-k top_k] [-p top_p] [-r seed] [-c cache] [-w packed] token...\n", argv[0]);
+                exit(1);
+        }
+    }
+    int prompt_len = argc - optind;
 
     GPT2 model;
-    gpt2_build_from_checkpoint(&model, "gpt2_124M.bin");
+    gpt2_build_from_checkpoint(&model, checkpoint_path, packed_path);
     const int n = 10;  // Token limit.
 
-    if (argc == 1) {
+    Sampler sampler;
+    sampler_init(&sampler, model.config.vocab_size, temperature, top_k, top_p, seed);
+    PrefixCache cache;
+    prefix_cache_init(&cache, &model, PREFIX_CACHE_BYTES);
+    if (cache_path != NULL) {
+        prefix_cache_fingerprint(&cache, &model, checkpoint_path);
+        prefix_cache_load(&cache, &model, cache_path);
+    }
+
+    if (num_slots > 0) {
+        serve(&model, &sampler, &cache, num_slots, n);
+        if (cache_path != NULL) {
+            prefix_cache_save(&cache, cache_path);
+        }
+        prefix_cache_free(&cache);
+        sampler_free(&sampler);
+        gpt2_free(&model);
+        return 0;
+    }
+
+    if (prompt_len == 0) {
         printf("Provide at least one token.\n");
         exit(1);
     }
-    if (argc > n) {
+    if (prompt_len >= n) {
         printf("Tow many tokens.\n");
         exit(1);
     }
@@ -721,23 +3184,35 @@ int main(int argc, char** argv) {
     int tokens[n];
 
     for (int i = 0; i < n; i++) {
-        if (i + 1 < argc) {
-            tokens[i] = strtol(argv[i + 1], NULL, 10);
+        if (i < prompt_len) {
+            tokens[i] = strtol(argv[optind + i], NULL, 10);
         } else {
             tokens[i] = GPT2_EOT;
         }
     }
 
-    for (int t = argc - 1; t < n; t++) {
-        gpt2_forward(&model, tokens, 1, t);
-        float* probs = model.acts.probs + (t-1) * model.config.vocab_size;
-        int next_token = sample_mult(probs, model.config.vocab_size);
+    // the first step runs the part of the prompt that is not in the prefix cache,
+    // every later step only the newest token
+    gpt2_alloc_kv_cache(&model, 1);
+    int pos = prefix_cache_lookup(&cache, &model, tokens, prompt_len, 0);
+    for (int t = prompt_len; t < n; t++) {
+        gpt2_decode(&model, tokens + pos, 1, t - pos, pos);
+        if (t == prompt_len) {
+            prefix_cache_insert(&cache, &model, tokens, prompt_len, 0);
+        }
+        pos = t;
+        int next_token = sampler_sample(&sampler, model.infer.logits, model.config.vocab_size);
         tokens[t] = next_token;
 
         printf("%d\n", tokens[t]);
         fflush(stdout);
     }
 
+    if (cache_path != NULL) {
+        prefix_cache_save(&cache, cache_path);
+    }
+    prefix_cache_free(&cache);
+    sampler_free(&sampler);
     gpt2_free(&model);
 
     return 0;
@@ -0,0 +1,58 @@
+import sys
+import numpy as np
+
+# Convert a version 1 (fp32) checkpoint into a version 2 one, where the matmul
+# weights are stored in the Q8_0 format gpt.c reads: for each tensor the int8
+# values, followed by one float32 scale for every QK consecutive values.
+#
+#   python3 quantize.py gpt2_124M.bin gpt2_124M_q8.bin
+#   ./gpt-64 -m gpt2_124M_q8.bin 31373 11 616
+
+QK = 32
+QUANTIZED = {0, 4, 6, 10, 12}  # wte, qkvw, attprojw, fcw, fcprojw
+
+if len(sys.argv) != 3:
+    print(f"Usage: {sys.argv[0]} input.bin output.bin")
+    sys.exit(1)
+
+with open(sys.argv[1], "rb") as f:
+    header = np.frombuffer(f.read(256 * 4), dtype=np.int32).copy()
+    params = np.frombuffer(f.read(), dtype=np.float32)
+
+if header[0] != 20240326 or header[1] != 1:
+    print("Expected a version 1 model file")
+    sys.exit(1)
+
+maxT, V, L, NH, C = (int(x) for x in header[2:7])
+if C % QK != 0:
+    print(f"channels ({C}) must be a multiple of {QK}")
+    sys.exit(1)
+
+sizes = [
+    V * C, maxT * C, L * C, L * C,
+    L * 3 * C * C, L * 3 * C, L * C * C, L * C,
+    L * C, L * C, L * 4 * C * C, L * 4 * C,
+    L * C * 4 * C, L * C, C, C,
+]
+if sum(sizes) != params.size:
+    print("Model file size does not match its header")
+    sys.exit(1)
+
+header[1] = 2
+header[7] = QK
+
+with open(sys.argv[2], "wb") as f:
+    f.write(header.tobytes())
+    offset = 0
+    for i, size in enumerate(sizes):
+        w = params[offset:offset + size]
+        offset += size
+        if i not in QUANTIZED:
+            f.write(w.tobytes())
+            continue
+        blocks = w.reshape(-1, QK)
+        d = np.abs(blocks).max(axis=1) / 127.0
+        inv = np.divide(1.0, d, out=np.zeros_like(d), where=d != 0)
+        q = np.rint(blocks * inv[:, None]).clip(-127, 127).astype(np.int8)
+        f.write(q.tobytes())
+        f.write(d.astype(np.float32).tobytes())
@@ -21,7 +21,7 @@ struct thread {
 };
 
 // You only allow to create a small number of threads.
-static struct thread threads_[16];
+static struct thread threads_[64];
 static int n_ = 0;
 
 // This is the entry for a created POSIX thread. It "wraps"